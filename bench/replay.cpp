@@ -0,0 +1,172 @@
+// Recording replay shared by the bench tools, see replay.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include "lzss.h"
+#include "replay.h"
+
+// What the firmware keeps in RTC memory and SPIFFS, here in plain memory
+thread_local unsigned long bootCount = 0;
+static thread_local std::vector<TrackedContact> overflowStore; // By record position, like OVERFLOW_FILE
+
+bool spillTrackedDevice(int position, const TrackedContact& contact) {
+  overflowStore[position] = contact;
+  return true;
+}
+
+bool restoreTrackedDevice(int position, const uint8_t* deviceAddress, TrackedContact& contact) {
+  const TrackedContact& stored = overflowStore[position];
+  if (!stored.used || memcmp(stored.address, deviceAddress, MAC_ADDRESS_LENGTH) != 0) return false;
+  contact = stored;
+  return true;
+}
+
+// The boot being replayed, where recordEvictedContact() logs to
+struct ReplayBoot {
+  BenchStats* stats;
+  bool sessionLogged;
+  uint32_t lastLoggedTime;
+};
+static thread_local ReplayBoot replayBoot;
+
+// Evaluate one peer seen this boot and log it the way recordDeviceContact() does
+static void logContact(int slot, uint32_t time) {
+  BenchStats& stats = *replayBoot.stats;
+  ContactUpdate update;
+  bool shouldLog = evaluateContact(slot, time, update);
+  stats.peerScans++;
+  stats.closeScans += trackedDevices[slot].lastCloseContactTime > 0;
+  if (!shouldLog) return;
+
+  uint8_t record[2 * LOG_MAX_RECORD_SIZE];
+  size_t length = 0;
+  if (!replayBoot.sessionLogged) {
+    length += encodeSessionRecord(record, replayBoot.lastLoggedTime, 0, 0);
+    replayBoot.sessionLogged = true;
+  }
+  length += encodeContactRecord(record + length, trackedDevices[slot].address, update.rssi,
+                                time - replayBoot.lastLoggedTime, update.contactDuration,
+                                update.closeContactDuration, update.isExposure, update.event);
+  replayBoot.lastLoggedTime = time;
+  stats.logBytes += length;
+  stats.log.insert(stats.log.end(), record, record + length);
+  stats.records++;
+  stats.exposures += update.event == LOG_EVENT_EXPOSURE && update.isExposure;
+}
+
+void recordEvictedContact(int slot, unsigned long currentTime) {
+  replayBoot.stats->evictedScans++;
+  logContact(slot, currentTime);
+}
+
+static void resetTracker() {
+  memset(trackedDevices, 0, sizeof(trackedDevices));
+  memset(overflowIndex, 0, sizeof(overflowIndex));
+  trackedDeviceCount = 0;
+  overflowDeviceCount = 0;
+  overflowDropCount = 0;
+  overflowStore.assign(MAX_OVERFLOW_DEVICES, TrackedContact());
+  bootCount = 0;
+}
+
+void replayBoots(const std::vector<BenchBoot>& boots, BenchStats& stats) {
+  resetTracker();
+  if (boots.empty()) return;
+  for (const BenchBoot& boot : boots) {
+    bootCount++;
+    replayBoot = {&stats, false, boot.time};
+    auto start = std::chrono::steady_clock::now();
+    for (const BenchSighting& sighting : boot.sightings) {
+      bool newThisBoot;
+      recordSighting(sighting.address, sighting.rssi, boot.time, newThisBoot);
+    }
+    stats.lookupSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats.lookups += boot.sightings.size();
+
+    for (int slot = 0; slot < TRACKED_TABLE_SIZE; slot++) {
+      if (trackedDevices[slot].used && wasSeenThisBoot(slot)) logContact(slot, boot.time);
+    }
+    if ((size_t)overflowDeviceCount > stats.peakOverflow) stats.peakOverflow = overflowDeviceCount;
+  }
+  stats.spanSeconds += boots.back().time - boots.front().time;
+  stats.droppedPeers += overflowDropCount;
+}
+
+static bool parseAddress(const std::string& text, uint8_t* address) {
+  unsigned int bytes[MAC_ADDRESS_LENGTH];
+  if (sscanf(text.c_str(), "%x:%x:%x:%x:%x:%x", &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4],
+             &bytes[5]) != MAC_ADDRESS_LENGTH) {
+    return false;
+  }
+  for (int i = 0; i < MAC_ADDRESS_LENGTH; i++) address[i] = bytes[i];
+  return true;
+}
+
+// Rows arrive in upload order, which isn't always time order
+std::vector<BenchBoot> loadRecording(const std::filesystem::path& path) {
+  std::vector<std::pair<uint32_t, BenchSighting>> rows;
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    char peer[32];
+    unsigned long timestamp;
+    int rssi;
+    if (sscanf(line.c_str(), "%lu,%31[^,],%d", &timestamp, peer, &rssi) != 3) continue; // Header
+    BenchSighting sighting;
+    if (!parseAddress(peer, sighting.address)) continue;
+    if (timestamp > UINT32_MAX) continue; // A few rows have a garbled timestamp
+    sighting.rssi = rssi;
+    rows.push_back({(uint32_t)timestamp, sighting});
+  }
+  std::stable_sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  std::vector<BenchBoot> boots;
+  for (const auto& row : rows) {
+    if (boots.empty() || boots.back().time != row.first) {
+      boots.push_back({row.first, {}});
+    }
+    boots.back().sightings.push_back(row.second);
+  }
+  return boots;
+}
+
+std::vector<std::filesystem::path> findRecordings(const std::filesystem::path& dir) {
+  std::vector<std::filesystem::path> paths;
+  std::error_code error;
+  for (const auto& entry : std::filesystem::recursive_directory_iterator(dir, error)) {
+    std::string path = entry.path().string();
+    if (entry.path().extension() == ".csv" && path.find("compiled_data") == std::string::npos &&
+        path.find("boot_stats") == std::string::npos && path.find("contact_pairs") == std::string::npos) {
+      paths.push_back(entry.path());
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+  return paths;
+}
+
+static_assert(UPLOAD_CHUNK_SIZE <= LZSS_MAX_INPUT, "UPLOAD_CHUNK_SIZE must fit the LZSS hash chains");
+
+uint64_t compressedSize(const std::vector<uint8_t>& log) {
+  uint8_t packed[UPLOAD_CHUNK_SIZE];
+  uint8_t unpacked[UPLOAD_CHUNK_SIZE];
+  uint64_t sent = 0;
+  for (size_t offset = 0; offset < log.size(); offset += UPLOAD_CHUNK_SIZE) {
+    size_t length = std::min((size_t)UPLOAD_CHUNK_SIZE, log.size() - offset);
+    size_t packedLength = lzssCompress(log.data() + offset, length, packed, length - 1);
+    if (packedLength == 0) {
+      sent += length;
+      continue;
+    }
+    if (lzssDecompress(packed, packedLength, unpacked, sizeof(unpacked)) != length ||
+        memcmp(unpacked, log.data() + offset, length) != 0) {
+      fprintf(stderr, "LZSS round trip failed at offset %zu\n", offset);
+      exit(1);
+    }
+    sent += packedLength;
+  }
+  return sent;
+}
@@ -0,0 +1,53 @@
+// Recording replay shared by the bench tools: in-memory overflow hooks, the CSV loader
+// and the loop that runs boots through ../contact_tracker.cpp the way the firmware does.
+// Everything here is per thread like the tracker itself.
+#ifndef BENCH_REPLAY_H
+#define BENCH_REPLAY_H
+
+#include <stdint.h>
+#include <filesystem>
+#include <vector>
+#include "contact_tracker.h"
+
+struct BenchSighting {
+  uint8_t address[MAC_ADDRESS_LENGTH];
+  int rssi;
+};
+
+// One wake: its start time and every advertisement its scan caught
+struct BenchBoot {
+  uint32_t time;
+  std::vector<BenchSighting> sightings;
+};
+
+struct BenchStats {
+  uint64_t lookups = 0;
+  double lookupSeconds = 0;
+  uint64_t records = 0;
+  uint64_t exposures = 0;
+  uint64_t logBytes = 0;
+  uint32_t spanSeconds = 0;
+  size_t peakOverflow = 0;
+  uint64_t droppedPeers = 0; // Lost from a full overflow store while still recent
+  uint64_t peerScans = 0; // Peers evaluated after a scan
+  uint64_t closeScans = 0; // Of those, how many were in close contact
+  uint64_t evictedScans = 0; // Of those, how many were evaluated as they were evicted mid-scan
+  std::vector<uint8_t> log; // The upload stream, as the firmware logs it
+};
+
+// Run boots through the tracker the way performScan() and recordScanContacts() do,
+// peers evicted mid-scan are logged as they go like recordEvictedContact() does
+void replayBoots(const std::vector<BenchBoot>& boots, BenchStats& stats);
+
+// Read timeStamp,peerId,rssi,... rows (the data/ recordings and the server's device
+// files alike), every distinct timestamp is one boot
+std::vector<BenchBoot> loadRecording(const std::filesystem::path& path);
+
+// Every recording CSV under a directory, skipping data/compiled_data*
+std::vector<std::filesystem::path> findRecordings(const std::filesystem::path& dir);
+
+// Payload bytes an upload of the log sends: UPLOAD_CHUNK_SIZE chunks compressed the way the
+// firmware does, or raw where they don't shrink. Every chunk is checked to come back intact.
+uint64_t compressedSize(const std::vector<uint8_t>& log);
+
+#endif // !BENCH_REPLAY_H
@@ -0,0 +1,101 @@
+// Host benchmark for the contact and exposure engine (../contact_tracker.cpp).
+// Replays the recorded CSVs under data/Device*/ and synthetic crowds through the
+// same code the firmware runs and reports lookups/sec, log bytes written per hour,
+// how well the log compresses for upload (../lzss.cpp) and memory footprint.
+//
+// Usage: ./tracker_bench [data dir] [hours of synthetic crowd]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <filesystem>
+#include <random>
+#include <vector>
+#include "replay.h"
+
+// Peers wandering around at 0.5-10 m, heard through the path loss model plus noise
+static std::vector<BenchBoot> makeCrowd(int peers, double hours, unsigned seed) {
+  std::mt19937 random(seed);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::normal_distribution<double> noise(0, 6);
+  std::vector<BenchSighting> crowd(peers);
+  std::vector<double> distance(peers);
+  for (int i = 0; i < peers; i++) {
+    for (int b = 0; b < MAC_ADDRESS_LENGTH; b++) crowd[i].address[b] = random();
+    distance[i] = 0.5 + 9.5 * uniform(random);
+  }
+
+  const int wakeSeconds = SLEEP_TIME_SECONDS + 2; // Scans usually exit after a couple of seconds
+  const int advertisementsPerScan = 3;
+  std::vector<BenchBoot> boots;
+  for (uint32_t t = 0; t < hours * 3600; t += wakeSeconds) {
+    BenchBoot boot{1700000000 + t, {}};
+    for (int i = 0; i < peers; i++) {
+      distance[i] = fmin(10, fmax(0.5, distance[i] + 0.3 * (uniform(random) - 0.5)));
+      if (uniform(random) > 0.8) continue; // Missed this scan
+      double meanRssi = PATH_LOSS_RSSI_AT_1M - 10 * PATH_LOSS_EXPONENT * log10(distance[i]);
+      for (int a = 0; a < advertisementsPerScan; a++) {
+        BenchSighting sighting = crowd[i];
+        sighting.rssi = (int)lround(fmax(MIN_RSSI, meanRssi + noise(random)));
+        boot.sightings.push_back(sighting);
+      }
+    }
+    boots.push_back(std::move(boot));
+  }
+  return boots;
+}
+
+// Raw log bytes per byte an upload sends for them
+static double compressionRatio(const std::vector<uint8_t>& log) {
+  return log.empty() ? 0 : (double)log.size() / compressedSize(log);
+}
+
+static void printStats(const char* name, const BenchStats& stats) {
+  double hours = stats.spanSeconds / 3600.0;
+  printf("%-28s %10llu %12.0f %8llu %9llu %12.0f %6.2fx %9zu %8llu\n", name, (unsigned long long)stats.lookups,
+         stats.lookupSeconds > 0 ? stats.lookups / stats.lookupSeconds : 0.0, (unsigned long long)stats.records,
+         (unsigned long long)stats.exposures, hours > 0 ? stats.logBytes / hours : 0.0, compressionRatio(stats.log),
+         stats.peakOverflow, (unsigned long long)stats.droppedPeers);
+}
+
+int main(int argc, char** argv) {
+  std::filesystem::path dataDir = argc > 1 ? argv[1] : "../data";
+  double crowdHours = argc > 2 ? atof(argv[2]) : 24;
+
+  printf("Tracker memory: %zu B table (%d slots x %zu B) + %zu B overflow index in RTC, "
+         "%zu B per overflowed peer in flash (max %d)\n\n",
+         sizeof(trackedDevices), TRACKED_TABLE_SIZE, sizeof(TrackedContact), sizeof(overflowIndex),
+         sizeof(TrackedContact), MAX_OVERFLOW_DEVICES);
+  printf("%-28s %10s %12s %8s %9s %12s %7s %9s %8s\n", "workload", "lookups", "lookups/s", "records", "exposures",
+         "bytes/hour", "lzss", "overflow", "dropped");
+
+  // Recordings are tiny, so replay them until the timing is worth something
+  std::vector<std::vector<BenchBoot>> recordings;
+  for (const auto& path : findRecordings(dataDir)) recordings.push_back(loadRecording(path));
+  if (recordings.empty()) {
+    printf("No recordings under %s\n", dataDir.string().c_str());
+  } else {
+    BenchStats total;
+    double lookups = 0, seconds = 0;
+    for (int pass = 0; pass < 1000 && seconds < 0.2; pass++) {
+      BenchStats stats;
+      for (const auto& boots : recordings) replayBoots(boots, stats);
+      lookups += stats.lookups;
+      seconds += stats.lookupSeconds;
+      if (pass == 0) total = stats;
+    }
+    total.lookupSeconds = seconds * total.lookups / lookups;
+    char name[64];
+    snprintf(name, sizeof(name), "data/ (%zu recordings)", recordings.size());
+    printStats(name, total);
+  }
+
+  for (int peers : {10, 100, 1000}) {
+    BenchStats stats;
+    replayBoots(makeCrowd(peers, crowdHours, peers), stats);
+    char name[64];
+    snprintf(name, sizeof(name), "crowd of %d, %.0fh", peers, crowdHours);
+    printStats(name, stats);
+  }
+  return 0;
+}
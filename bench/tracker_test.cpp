@@ -0,0 +1,96 @@
+// Checks of the contact and exposure engine (../contact_tracker.cpp) on synthetic
+// scans, run through the same replay as the bench. Exits non-zero on a failure.
+//
+// Usage: ./tracker_test (or make test)
+#include <stdio.h>
+#include <vector>
+#include "replay.h"
+
+static int failures = 0;
+
+#define CHECK(condition)                                                 \
+  do {                                                                   \
+    if (!(condition)) {                                                  \
+      fprintf(stderr, "%s:%d: FAILED %s\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                        \
+    }                                                                    \
+  } while (0)
+
+// Peers standing at 1 m for a while, every scan hears each of them advertisements times.
+// Interleaved = the advertisements of all peers take turns, like a real scan.
+static std::vector<BenchBoot> makeCloseCrowd(int peers, int boots, int advertisements, bool interleaved,
+                                             int firstPeer = 0, uint32_t startTime = 1700000000u) {
+  std::vector<BenchBoot> result;
+  for (int b = 0; b < boots; b++) {
+    BenchBoot boot{startTime + (uint32_t)b * 30, {}};
+    for (int i = 0; i < peers * advertisements; i++) {
+      int peer = firstPeer + (interleaved ? i % peers : i / advertisements);
+      BenchSighting sighting = {{0x02, 0x00, 0x00, 0x00, (uint8_t)(peer >> 8), (uint8_t)peer}, (int)PATH_LOSS_RSSI_AT_1M};
+      boot.sightings.push_back(sighting);
+    }
+    result.push_back(std::move(boot));
+  }
+  return result;
+}
+
+// More peers than the RTC table holds: every one must still be evaluated every scan
+// and become an exposure, whether it stayed in the table or was spilled mid-scan
+static void testMorePeersThanTableSlots(bool interleaved) {
+  const int peers = MAX_TRACKED_DEVICES + 18;
+  const int boots = EXPOSURE_TIME_THRESHOLD / 30 + 4; // Past the threshold
+  BenchStats stats;
+  replayBoots(makeCloseCrowd(peers, boots, 3, interleaved), stats);
+  CHECK(stats.peerScans >= (uint64_t)peers * boots);
+  CHECK(stats.evictedScans > 0);
+  CHECK(stats.exposures == (uint64_t)peers);
+}
+
+// Within the table nothing is evicted, and every peer is evaluated exactly once per scan
+static void testFewerPeersThanTableSlots() {
+  const int peers = MAX_TRACKED_DEVICES / 2;
+  const int boots = EXPOSURE_TIME_THRESHOLD / 30 + 4;
+  BenchStats stats;
+  replayBoots(makeCloseCrowd(peers, boots, 3, true), stats);
+  CHECK(stats.peerScans == (uint64_t)peers * boots);
+  CHECK(stats.evictedScans == 0);
+  CHECK(stats.exposures == (uint64_t)peers);
+}
+
+// More peers than the table and the overflow store together: recent ones get dropped, visibly
+static void testOverflowDropsAreCounted() {
+  const int peers = MAX_TRACKED_DEVICES + MAX_OVERFLOW_DEVICES + 50;
+  BenchStats stats;
+  replayBoots(makeCloseCrowd(peers, 3, 1, false), stats);
+  CHECK(stats.peakOverflow == MAX_OVERFLOW_DEVICES);
+  CHECK(stats.droppedPeers > 0);
+}
+
+// A crowd that fills the store and leaves, then another one long after: the first
+// crowd's records expire and are reused without counting as drops
+static void testOverflowExpires() {
+  const int peers = MAX_TRACKED_DEVICES + MAX_OVERFLOW_DEVICES;
+  std::vector<BenchBoot> boots = makeCloseCrowd(peers, 2, 1, false);
+  uint32_t later = boots.back().time + 2 * OVERFLOW_EXPIRY_SECONDS;
+  for (uint32_t time = boots.back().time + MAX_SLEEP_TIME_SECONDS; time < later; time += MAX_SLEEP_TIME_SECONDS) {
+    boots.push_back({time, {}}); // Backed off, alone
+  }
+  for (BenchBoot& boot : makeCloseCrowd(peers, 2, 1, false, peers, later)) boots.push_back(std::move(boot));
+  BenchStats stats;
+  replayBoots(boots, stats);
+  CHECK(stats.peakOverflow == MAX_OVERFLOW_DEVICES);
+  CHECK(stats.droppedPeers == 0);
+}
+
+int main() {
+  testMorePeersThanTableSlots(false);
+  testMorePeersThanTableSlots(true);
+  testFewerPeersThanTableSlots();
+  testOverflowDropsAreCounted();
+  testOverflowExpires();
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All tracker checks passed\n");
+  return 0;
+}
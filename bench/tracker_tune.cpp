@@ -0,0 +1,213 @@
+// Offline tuning of the distance model, close contact and exposure definition and
+// logging (TrackerConfig in ../contact_tracker.h). Replays recordings through the same
+// engine the firmware runs under a grid of configurations, in parallel on every core,
+// and reports for each precision/recall plus the log written and uploaded per hour.
+//
+// Recordings are the timeStamp,peerId,rssi,... CSVs of data/Device*/ and the server's
+// received_data/ device files. Ones whose file name starts with a distance ("2m_...")
+// are labelled: a recording at or within --close meters is a close contact the whole
+// time (the data/ sets are ~25 minutes each, so also an exposure), one further out is
+// neither. Unlabelled recordings only count towards the volumes.
+//
+// Usage: ./tracker_tune [-j threads] [--close meters] [--top N] [--csv file] [dir...]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lzss.h"
+#include "replay.h"
+
+struct Recording {
+  std::string name;
+  float distance; // Meters, < 0 = not labelled
+  std::vector<BenchBoot> boots;
+};
+
+struct Counts {
+  uint64_t truePositives = 0;
+  uint64_t falsePositives = 0;
+  uint64_t falseNegatives = 0;
+
+  void add(bool predicted, bool actual, uint64_t weight = 1) {
+    if (predicted && actual) truePositives += weight;
+    if (predicted && !actual) falsePositives += weight;
+    if (!predicted && actual) falseNegatives += weight;
+  }
+  double precision() const {
+    return truePositives + falsePositives > 0 ? (double)truePositives / (truePositives + falsePositives) : 0;
+  }
+  double recall() const {
+    return truePositives + falseNegatives > 0 ? (double)truePositives / (truePositives + falseNegatives) : 0;
+  }
+  double f1() const {
+    double p = precision(), r = recall();
+    return p + r > 0 ? 2 * p * r / (p + r) : 0;
+  }
+};
+
+struct Result {
+  Counts exposures; // Per labelled recording: did the peer become an exposure
+  Counts closeScans; // Per peer per scan: was it in close contact
+  double writeBytesPerHour = 0;
+  double uploadBytesPerHour = 0;
+};
+
+static Result evaluate(const TrackerConfig& config, const std::vector<Recording>& recordings, float closeDistance) {
+  setTrackerConfig(config);
+  Result result;
+  uint64_t logBytes = 0, uploadBytes = 0, seconds = 0;
+  for (const Recording& recording : recordings) {
+    BenchStats stats;
+    replayBoots(recording.boots, stats);
+    if (recording.distance >= 0) {
+      bool close = recording.distance <= closeDistance;
+      result.exposures.add(stats.exposures > 0, close);
+      result.closeScans.add(true, close, stats.closeScans);
+      result.closeScans.add(false, close, stats.peerScans - stats.closeScans);
+    }
+    uint64_t chunks = (stats.log.size() + UPLOAD_CHUNK_SIZE - 1) / UPLOAD_CHUNK_SIZE;
+    logBytes += stats.logBytes;
+    uploadBytes += compressedSize(stats.log) + chunks * UPLOAD_HEADER_SIZE;
+    seconds += stats.spanSeconds;
+  }
+  double hours = seconds / 3600.0;
+  result.writeBytesPerHour = hours > 0 ? logBytes / hours : 0;
+  result.uploadBytesPerHour = hours > 0 ? uploadBytes / hours : 0;
+  return result;
+}
+
+// The grid searched, a few hundred points around the constants.h defaults
+static std::vector<TrackerConfig> makeGrid() {
+  std::vector<TrackerConfig> grid;
+  for (float enter : {1.0f, 1.5f, 2.0f, 2.5f, 3.0f}) {
+    for (float hysteresis : {1.0f, 1.5f, 2.0f}) {
+      for (int shift : {0, 1, 2, 3}) {
+        for (uint32_t threshold : {60, 180, 300, 600, 900}) {
+          for (bool windowed : {false, true}) {
+            for (bool eventsOnly : {false, true}) {
+              TrackerConfig config;
+              config.closeContactEnterDistance = enter;
+              config.closeContactExitDistance = enter * hysteresis;
+              config.rssiFilterShift = shift;
+              config.exposureTimeThreshold = threshold;
+              config.exposureWindowed = windowed;
+              config.logEventsOnly = eventsOnly;
+              grid.push_back(config);
+            }
+          }
+        }
+      }
+    }
+  }
+  return grid;
+}
+
+static void printHeader(FILE* out, bool csv) {
+  const char* format = csv ? "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n"
+                           : "%5s %5s %5s %9s %8s %6s  %9s %9s  %7s %7s  %11s %12s\n";
+  fprintf(out, format, "enter", "exit", "shift", "threshold", "windowed", "events", "exposureP", "exposureR", "closeP",
+          "closeR", "write B/h", "upload B/h");
+}
+
+static void printResult(FILE* out, bool csv, const TrackerConfig& config, const Result& result) {
+  const char* format = csv ? "%.2f,%.2f,%d,%u,%d,%d,%.3f,%.3f,%.3f,%.3f,%.0f,%.0f\n"
+                           : "%5.2f %5.2f %5d %9u %8d %6d  %9.3f %9.3f  %7.3f %7.3f  %11.0f %12.0f\n";
+  fprintf(out, format, config.closeContactEnterDistance, config.closeContactExitDistance, config.rssiFilterShift,
+          config.exposureTimeThreshold, config.exposureWindowed, config.logEventsOnly, result.exposures.precision(),
+          result.exposures.recall(), result.closeScans.precision(), result.closeScans.recall(),
+          result.writeBytesPerHour, result.uploadBytesPerHour);
+}
+
+int main(int argc, char** argv) {
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  float closeDistance = 2.0f;
+  size_t top = 20;
+  const char* csvPath = nullptr;
+  std::vector<std::string> dirs;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      threads = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "--close") && i + 1 < argc) {
+      closeDistance = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--top") && i + 1 < argc) {
+      top = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--csv") && i + 1 < argc) {
+      csvPath = argv[++i];
+    } else {
+      dirs.push_back(argv[i]);
+    }
+  }
+  if (dirs.empty()) dirs.push_back("../data");
+
+  std::vector<Recording> recordings;
+  size_t labelled = 0;
+  for (const std::string& dir : dirs) {
+    for (const auto& path : findRecordings(dir)) {
+      Recording recording;
+      recording.name = path.string();
+      float meters;
+      char unit;
+      std::string file = path.filename().string();
+      recording.distance = sscanf(file.c_str(), "%f%c_", &meters, &unit) == 2 && unit == 'm' ? meters : -1;
+      recording.boots = loadRecording(path);
+      labelled += recording.distance >= 0;
+      if (!recording.boots.empty()) recordings.push_back(std::move(recording));
+    }
+  }
+  if (recordings.empty()) {
+    fprintf(stderr, "No recordings found\n");
+    return 1;
+  }
+
+  // Every thread has a tracker of its own, they only share the read-only recordings
+  std::vector<TrackerConfig> grid = makeGrid();
+  grid.insert(grid.begin(), TrackerConfig()); // constants.h, to compare against
+  std::vector<Result> results(grid.size());
+  std::atomic<size_t> next{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&]() {
+      for (size_t i = next++; i < grid.size(); i = next++) {
+        results[i] = evaluate(grid[i], recordings, closeDistance);
+      }
+    });
+  }
+  for (std::thread& worker : workers) worker.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("%zu configurations x %zu recordings (%zu labelled, close = within %.1f m) in %.2f s on %u threads\n\n",
+         grid.size(), recordings.size(), labelled, closeDistance, seconds, threads);
+  printHeader(stdout, false);
+  printResult(stdout, false, grid[0], results[0]);
+  printf("\nBest by exposure F1, then close contact F1, then upload volume:\n");
+
+  std::vector<size_t> order(grid.size() - 1);
+  for (size_t i = 0; i < order.size(); i++) order[i] = i + 1;
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    const Result& x = results[a];
+    const Result& y = results[b];
+    if (x.exposures.f1() != y.exposures.f1()) return x.exposures.f1() > y.exposures.f1();
+    if (x.closeScans.f1() != y.closeScans.f1()) return x.closeScans.f1() > y.closeScans.f1();
+    return x.uploadBytesPerHour < y.uploadBytesPerHour;
+  });
+  printHeader(stdout, false);
+  for (size_t i = 0; i < std::min(top, order.size()); i++) printResult(stdout, false, grid[order[i]], results[order[i]]);
+
+  if (csvPath) {
+    FILE* csv = fopen(csvPath, "w");
+    if (!csv) {
+      perror(csvPath);
+      return 1;
+    }
+    printHeader(csv, true);
+    for (size_t i = 0; i < grid.size(); i++) printResult(csv, true, grid[i], results[i]);
+    fclose(csv);
+  }
+  return 0;
+}
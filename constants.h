@@ -4,29 +4,169 @@
 
 // Time conversions
 #define SECONDS_TO_MICROSECONDS 1000000
-#define SLEEP_TIME_SECONDS 5
+#define SLEEP_TIME_SECONDS 5 // Sleep between scans while peers are around
 
-// File storage
-#define DATA_FILE "/data.csv"
+// Adaptive sleep: the interval doubles for every scan in a row that saw no tracer
+// peers, and drops to the minimum while a close contact is about to become an
+// exposure. The energy budget is enforced on top: once the saved-up credit runs
+// out, the device sleeps at least as long as it needs to average out to the budget.
+#define MIN_SLEEP_TIME_SECONDS 2 // While a close contact is within EXPOSURE_APPROACH_WINDOW of the threshold
+#define MAX_SLEEP_TIME_SECONDS 300 // Longest idle backoff
+#define EXPOSURE_APPROACH_WINDOW 60 // Seconds of close contact left before exposure that count as "about to"
+#define ENERGY_BUDGET_MAH_PER_DAY 40 // e.g. a 1000 mAh cell lasting ~25 days
+#define SLEEP_CURRENT_UA 15 // Deep sleep draw
+#define ENERGY_CREDIT_SECONDS 3600 // Budget that can be saved up for busy periods
+
+// Deep sleep wake stub: sleeps longer than WAKE_STUB_TICK_SECONDS run as several timer
+// ticks, and the ticks before the last one are handled by a stub in RTC memory that
+// counts them down and goes straight back to sleep, about a millisecond awake with
+// flash, the Arduino core and the radios never started. Only the last tick boots.
+#define WAKE_STUB 1 // 0 = one timer sleep per interval, every wake boots
+#define WAKE_STUB_TICK_SECONDS 60
+
+// Boot phase instrumentation: each phase is timed in microseconds and its charge
+// estimated from these current figures (mA). The last BOOT_STATS_RING_SIZE boots
+// are kept in RTC memory and sent as a "# Boot Stats:" line with each upload.
+#define BOOT_STATS_RING_SIZE 8
+#define PHASE_CURRENT_OTHER_MA 25 // CPU awake, radios off
+#define PHASE_CURRENT_STORAGE_MA 30 // SPIFFS mount and log recovery
+#define PHASE_CURRENT_WIFI_CONNECT_MA 110 // Association + DHCP, also the Wi-Fi teardown
+#define PHASE_CURRENT_NTP_MA 90
+#define PHASE_CURRENT_BLE_INIT_MA 40 // Controller bring-up and advertising setup, also the teardown
+#define PHASE_CURRENT_SCAN_MA 60 // Passive scan at BLE_SCAN_WINDOW / BLE_SCAN_INTERVAL duty cycle
+#define PHASE_CURRENT_PROCESSING_MA 60 // Tracker work, the scan keeps running in the background
+#define PHASE_CURRENT_FLASH_WRITE_MA 45
+#define PHASE_CURRENT_UPLOAD_MA 110
+#define PHASE_CURRENT_SLEEP_ENTRY_MA 25
+
+// Upload policy: Wi-Fi only comes up when there's a reason to. With data pending, any of
+// these triggers an upload; after a failed one, uploads back off exponentially.
+#define UPLOAD_PENDING_BYTES 4096 // Enough logged to be worth the Wi-Fi connect
+#define UPLOAD_ON_EXPOSURE 1 // Upload right away when a peer becomes an exposure
+#define UPLOAD_MAX_STALENESS 1800 // Seconds the oldest pending record may wait
+#define UPLOAD_RETRY_MIN_BACKOFF 60 // Seconds after the first failure, doubling per failure
+#define UPLOAD_RETRY_MAX_BACKOFF 3600
+
+// Upload transport datagrams (the rest of UPLOAD_* is in the sketch)
+#define UPLOAD_HEADER_SIZE 12 // "CU", type, flags, uint32 stream ID, uint32 byte offset
+#define UPLOAD_CHUNK_SIZE 1024 // Payload bytes per datagram, keeps packets under the MTU
+
+// Contact log storage: an append-only ring of segment files on SPIFFS. Records
+// are addressed by a logical byte position that only grows; position p lives in
+// segment p / LOG_SEGMENT_SIZE. LOG_STATE_FILE keeps the position uploaded up to,
+// so a successful upload just moves it and deletes the fully uploaded segments.
+#define LOG_SEGMENT_FILE "/log%lu.bin"
+#define LOG_SEGMENT_SIZE 16384
+#define LOG_SEGMENT_COUNT 8 // Segments kept on flash, the oldest is dropped when a new one would exceed this
+#define LOG_STATE_FILE "/log.ptr"
+
+// Binary contact log format (little-endian), decoded to CSV by the server
+//   upload:  LOG_MAGIC, then the records from the commit position on
+//   session: tag, uint32 start time, uint32 device ID (first 4 bytes of the rolling ID), varint upload duration (ms)
+//   contact: tag (bits 4-6 = event, bit 7 = exposure), 6-byte MAC, int8 RSSI, varint seconds
+//            since previous record, varint contact duration, varint close contact duration
+//   Every segment starts with a session record, so it can be decoded on its own
+#define LOG_MAGIC "CTB1"
+#define LOG_MAGIC_LENGTH 4
+#define LOG_RECORD_SESSION 0x00
+#define LOG_RECORD_CONTACT 0x01
+#define LOG_RECORD_PADDING 0x02 // Single byte filling the end of a segment, records never straddle two
+#define LOG_RECORD_TYPE_MASK 0x0F
+#define LOG_EVENT_SHIFT 4
+#define LOG_FLAG_EXPOSURE 0x80
+
+// What made a contact record worth writing
+#define LOG_EVENT_SIGHTING 0 // Seen this scan (LOG_EVENTS_ONLY off)
+#define LOG_EVENT_FIRST_SEEN 1
+#define LOG_EVENT_CLOSE_START 2
+#define LOG_EVENT_CLOSE_END 3
+#define LOG_EVENT_EXPOSURE 4 // Exposure status flipped
+#define LOG_EVENT_SUMMARY 5 // Nothing changed for LOG_SUMMARY_INTERVAL
+
+#define LOG_EVENTS_ONLY 1 // Only log state changes and periodic summaries, 0 = a record per peer per scan
+#define LOG_SUMMARY_INTERVAL 300 // Seconds between summaries of a peer that is still around
+#define LOG_MAX_RECORD_SIZE 24 // Worst case for either record type
+#define LOG_BUFFER_SIZE 2048 // Records held in RAM and appended to the log in one write
 
 // Bluetooth scanning
-#define SCAN_DURATION 10
+#define SCAN_DURATION 10 // Upper bound in seconds, the early exits below usually end it sooner
+#define BLE_ACTIVE_SCAN 0 // Passive is enough, our ID is in the advertisement itself (scan requests would go out from our public address)
+#define BLE_SCAN_INTERVAL 100 // ms between scan windows
+#define BLE_SCAN_WINDOW 50 // ms listening per interval (radio duty cycle = window / interval)
+#define SCAN_EARLY_EXIT_PEERS 0 // Stop once this many tracer peers were seen (0 = off)
+#define SCAN_IDLE_TIMEOUT 3000 // Stop after this many ms without a new tracer peer (0 = off)
+#define SIGHTING_RING_SIZE 64 // Tracer advertisements buffered between the BLE callback and the storage task (power of two)
+#define STORAGE_TASK 1 // Process sightings and write the log on a task of their own, while the scan and BLE shutdown run (0 = inline)
+#define STORAGE_TASK_STACK 6144 // Bytes
+#define STORAGE_TASK_PRIORITY 2 // Above the Arduino loop task, so sightings are taken as they arrive
 #define MIN_RSSI -100
-#define CLOSE_CONTACT_RSSI -60    // ~1.5m distance
 #define EXPOSURE_TIME_THRESHOLD 300  // 5 minutes
 
+// Exposure definition. Every peer keeps its close time both in total and in a rolling
+// window (a ring of EXPOSURE_WINDOW_BUCKETS buckets), updated once per scan.
+#define EXPOSURE_WINDOWED 0 // 1 = EXPOSURE_TIME_THRESHOLD within the last EXPOSURE_WINDOW_SECONDS, 0 = in total
+#define EXPOSURE_WINDOW_SECONDS 900 // 15 minutes
+#define EXPOSURE_WINDOW_BUCKETS 5 // 3 minute buckets, each must fit in a byte
+
+// RSSI smoothing and distance model. Each peer's RSSI goes through an EWMA, then the
+// log-distance path loss model rssi = PATH_LOSS_RSSI_AT_1M - 10 * n * log10(d) turns it
+// into meters. The defaults are fitted to data/Device*/ with data/analysis_scripts/fit_path_loss.py.
+#define RSSI_FILTER_SHIFT 2 // New sample weight = 1 / 2^shift
+#define RSSI_FILTER_SCALE 16 // Filtered RSSI is kept in 1/16 dBm
+#define PATH_LOSS_RSSI_AT_1M -57.0
+#define PATH_LOSS_EXPONENT 1.6
+#define CLOSE_CONTACT_ENTER_DISTANCE 1.5 // m, getting this close starts a close contact
+#define CLOSE_CONTACT_EXIT_DISTANCE 2.5 // m, and it only ends once the peer is this far away
+
+// Contact tracking (override with build flags for crowded deployments)
+#ifndef MAX_TRACKED_DEVICES
+#define MAX_TRACKED_DEVICES 32 // Peers kept in RTC memory, least recently seen spill to flash
+#endif
+#ifndef TRACKED_TABLE_SIZE
+#define TRACKED_TABLE_SIZE 64 // Hash slots, power of two larger than MAX_TRACKED_DEVICES
+#endif
+#define OVERFLOW_FILE "/tracked.bin" // Peers evicted from RTC memory, a fixed-size record per index position
+#define MAX_OVERFLOW_DEVICES 512 // Records in OVERFLOW_FILE, each costs 4 B of index in RTC memory
+#define OVERFLOW_EXPIRY_SECONDS 3600 // A peer unseen this long is forgotten, its contact was logged as it left
+#define OVERFLOW_SPILL_BATCH 16 // Spills held in RAM and written to flash together at the end of the scan
+
 // Bluetooth configuration
+#define BLE_BEACON_ONLY 1 // Advertise straight through GAP, no GATT server (0 = also serve the "Hello" characteristic)
+#define BLE_ADV_INTERVAL_MIN 0x20 // 20 ms in 0.625 ms units, what BLEAdvertising uses
+#define BLE_ADV_INTERVAL_MAX 0x40 // 40 ms
 #define BLE_DEVICE_NAME "ESP32_ContactTracer" // Name of the BLE device
 #define SERVICE_UUID "12345678-1234-5678-1234-56789abcdef0" // UUID for the BLE service
 #define CHARACTERISTIC_UUID "abcdefab-1234-5678-1234-abcdefabcdef" // UUID for the BLE characteristic
 #define CHARACTERISTIC_VALUE "Hello" // Default value for the BLE characteristic  
 
+// Tracer advertisement, the manufacturer specific data of every tracer:
+//   uint16 company ID, version, ROLLING_ID_LENGTH byte rolling ID, int8 RSSI at 1 m (dBm)
+// The rolling ID is HMAC-SHA256(daily key, "CTRI" + uint32 interval number) cut to
+// ROLLING_ID_LENGTH, the daily key is random and only kept in RTC memory. The next 6 bytes
+// of the HMAC are the random address we advertise from, so the address rotates with the
+// ID. Peers are tracked and logged by the first MAC_ADDRESS_LENGTH bytes of their rolling
+// ID, never by their address.
+#define TRACER_COMPANY_ID 0xFFFF // Bluetooth SIG "no company", reserved for testing
+#define TRACER_ADV_VERSION 1
+#define TRACER_ADV_DATA_LENGTH 20 // Company ID + version + rolling ID + TX power
+#define ROLLING_ID_LENGTH 16
+#define ROLLING_ID_INTERVAL 900 // Seconds a rolling ID is advertised before the next one
+#define TRACER_TX_POWER -57 // What peers hear from us at 1 m, PATH_LOSS_RSSI_AT_1M rounded
+
 // Device identification
-#define DEVICE_ID_LENGTH 8 // Length of the device ID to create random id
 #define TIME_SERVER "pool.ntp.org" // NTP server for time synchronization
 
+// Wall clock (kept by the RTC across deep sleep, NTP only tops it up)
+#define NTP_SYNC_TIMEOUT 5000 // ms to wait for an NTP reply
+#define CLOCK_RESYNC_INTERVAL 3600 // Resync on upload cycles at most this often (seconds)
+#define MAX_CLOCK_DRIFT_SECONDS 2 // Resync early once the estimated drift exceeds this
+#define DEFAULT_CLOCK_DRIFT_PPM 500 // Assumed RTC drift until we have measured it
+#define MIN_DRIFT_MEASURE_SECONDS 600 // Shorter sync gaps are too noisy to measure drift
+
 // Set to 0 in production 
+#ifndef DEBUG_MODE
 #define DEBUG_MODE 1
+#endif
 
 #if DEBUG_MODE
     #define DEBUG_LOGF(...) Serial.printf(__VA_ARGS__)
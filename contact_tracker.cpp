@@ -0,0 +1,456 @@
+// Contact and exposure engine, see contact_tracker.h
+#ifdef ARDUINO
+#include <Arduino.h> // Serial for the DEBUG_LOG macros
+#endif
+#include <math.h>
+#include <string.h>
+#include "contact_tracker.h"
+
+// Memory to remember devices between sleep cycles
+RTC_DATA_ATTR TRACKER_THREAD_LOCAL TrackedContact trackedDevices[TRACKED_TABLE_SIZE];
+RTC_DATA_ATTR TRACKER_THREAD_LOCAL int trackedDeviceCount = 0;
+
+RTC_DATA_ATTR TRACKER_THREAD_LOCAL OverflowEntry overflowIndex[MAX_OVERFLOW_DEVICES];
+RTC_DATA_ATTR TRACKER_THREAD_LOCAL int overflowDeviceCount = 0;
+RTC_DATA_ATTR TRACKER_THREAD_LOCAL uint32_t overflowDropCount = 0;
+
+TRACKER_THREAD_LOCAL TrackerConfig trackerConfig;
+
+// Helper functions for tracking devices between sleep cycles
+
+// Spread MAC addresses over the table (FNV-1a)
+uint32_t hashDeviceAddress(const uint8_t* deviceAddress) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < MAC_ADDRESS_LENGTH; i++) {
+    hash = (hash ^ deviceAddress[i]) * 16777619u;
+  }
+  return hash;
+}
+
+int homeSlot(const uint8_t* deviceAddress) {
+  return hashDeviceAddress(deviceAddress) & (TRACKED_TABLE_SIZE - 1);
+}
+
+// Probe for a device, returns its slot or the empty slot where it would go
+int probeTrackedDevice(const uint8_t* deviceAddress, bool& found) {
+  int slot = homeSlot(deviceAddress);
+  found = false;
+  for (int probe = 0; probe < TRACKED_TABLE_SIZE; probe++) {
+    if (!trackedDevices[slot].used) {
+      return slot; // Hit an empty slot, so it's not in the table
+    }
+    if (memcmp(trackedDevices[slot].address, deviceAddress, MAC_ADDRESS_LENGTH) == 0) {
+      found = true;
+      return slot;
+    }
+    slot = (slot + 1) & (TRACKED_TABLE_SIZE - 1);
+  }
+  return -1;
+}
+
+// Find a device in our tracking list
+int findTrackedDevice(const uint8_t* deviceAddress) {
+  bool found;
+  int slot = probeTrackedDevice(deviceAddress, found);
+  return found ? slot : -1;
+}
+
+// When did we first see this device?
+unsigned long getFirstSeenTime(int slot) {
+  return (slot >= 0) ? trackedDevices[slot].firstSeenTime : 0;
+}
+
+// Did this boot's scan already see this device?
+bool wasSeenThisBoot(int slot) {
+  return slot >= 0 && trackedDevices[slot].lastSeenBoot == bootCount;
+}
+
+// Overflow index tag of a MAC, never 0 (a free position)
+uint16_t overflowTag(const uint8_t* deviceAddress) {
+  uint16_t tag = hashDeviceAddress(deviceAddress) >> 16;
+  return tag ? tag : 1;
+}
+
+// Where to spill a device: a free position, or else the one of the peer gone longest
+int chooseOverflowPosition(unsigned long currentTime) {
+  uint16_t minute = currentTime / 60;
+  int oldest = 0;
+  uint16_t oldestAge = 0;
+  for (int position = 0; position < MAX_OVERFLOW_DEVICES; position++) {
+    if (overflowIndex[position].tag == 0) {
+      return position;
+    }
+    uint16_t age = minute - overflowIndex[position].lastSeenMinute;
+    if (age > oldestAge) {
+      oldest = position;
+      oldestAge = age;
+    }
+  }
+
+  overflowDeviceCount--; // It gets replaced
+  if (oldestAge < OVERFLOW_EXPIRY_SECONDS / 60) {
+    overflowDropCount++;
+    DEBUG_LOGN("-- LOG: Overflow store full, dropping the peer gone longest");
+  }
+  return oldest;
+}
+
+// Take a device back out of the overflow store if it's there
+bool restoreOverflowDevice(const uint8_t* deviceAddress, TrackedContact& contact) {
+  if (overflowDeviceCount == 0) return false;
+  uint16_t tag = overflowTag(deviceAddress);
+  for (int position = 0; position < MAX_OVERFLOW_DEVICES; position++) {
+    if (overflowIndex[position].tag == tag && restoreTrackedDevice(position, deviceAddress, contact)) {
+      overflowIndex[position].tag = 0;
+      overflowDeviceCount--;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Empty a slot, shifting later entries of the probe run back so lookups still find them
+void removeTrackedSlot(int slot) {
+  const int mask = TRACKED_TABLE_SIZE - 1;
+  int hole = slot;
+  int next = (slot + 1) & mask;
+  while (trackedDevices[next].used) {
+    int home = homeSlot(trackedDevices[next].address);
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      trackedDevices[hole] = trackedDevices[next];
+      hole = next;
+    }
+    next = (next + 1) & mask;
+  }
+  trackedDevices[hole].used = false;
+  trackedDeviceCount--;
+}
+
+// Still in a close contact: so far, and seen by this scan or the last one
+bool isRecentCloseContact(const TrackedContact& contact) {
+  return contact.lastCloseContactTime > 0 && contact.lastSeenBoot + 1 >= bootCount;
+}
+
+// Make room by spilling the least recently seen device, preferring ones not in close contact
+void evictTrackedDevice(unsigned long currentTime) {
+  int victim = -1;
+  for (int slot = 0; slot < TRACKED_TABLE_SIZE; slot++) {
+    const TrackedContact& contact = trackedDevices[slot];
+    if (!contact.used) continue;
+    if (victim < 0) {
+      victim = slot;
+      continue;
+    }
+    const TrackedContact& best = trackedDevices[victim];
+    bool contactIsClose = isRecentCloseContact(contact);
+    bool bestIsClose = isRecentCloseContact(best);
+    if ((!contactIsClose && bestIsClose) ||
+        (contactIsClose == bestIsClose && contact.lastSeenTime < best.lastSeenTime)) {
+      victim = slot;
+    }
+  }
+  if (victim < 0) return;
+
+  DEBUG_LOGF("Evicting device in slot %d to flash\n", victim);
+  if (wasSeenThisBoot(victim)) {
+    recordEvictedContact(victim, currentTime); // Before it leaves, or this scan never logs it
+  }
+  const TrackedContact& contact = trackedDevices[victim];
+  int position = chooseOverflowPosition(currentTime);
+  if (spillTrackedDevice(position, contact)) {
+    overflowIndex[position].tag = overflowTag(contact.address);
+    overflowIndex[position].lastSeenMinute = contact.lastSeenTime / 60;
+    overflowDeviceCount++;
+  } else {
+    overflowIndex[position].tag = 0;
+    overflowDropCount++;
+  }
+  removeTrackedSlot(victim);
+}
+
+// Find or start tracking a device and mark it as just seen, returns its slot.
+// seenThisBoot / filterStale tell whether it was already seen this boot (and evicted
+// since), or last seen before the previous boot.
+int trackDevice(const uint8_t* deviceAddress, unsigned long currentTime, bool& seenThisBoot, bool& filterStale) {
+  bool found;
+  int slot = probeTrackedDevice(deviceAddress, found);
+  seenThisBoot = false;
+  filterStale = false;
+  if (found) {
+    seenThisBoot = trackedDevices[slot].lastSeenBoot == bootCount;
+    filterStale = trackedDevices[slot].lastSeenBoot + 1 < bootCount;
+    trackedDevices[slot].lastSeenTime = currentTime;
+    trackedDevices[slot].lastSeenBoot = bootCount;
+    return slot; // Already tracking this one
+  }
+
+  // Seen before but evicted? Then keep its history
+  TrackedContact restored;
+  bool wasRestored = restoreOverflowDevice(deviceAddress, restored);
+  if (wasRestored) {
+    seenThisBoot = restored.lastSeenBoot == bootCount;
+    filterStale = restored.lastSeenBoot + 1 < bootCount;
+  }
+
+  if (trackedDeviceCount >= MAX_TRACKED_DEVICES) {
+    evictTrackedDevice(currentTime);
+    slot = probeTrackedDevice(deviceAddress, found); // Eviction may have shifted entries
+  }
+  if (slot < 0) {
+    return -1;
+  }
+
+  trackedDeviceCount++;
+  TrackedContact& contact = trackedDevices[slot];
+  if (wasRestored) {
+    contact = restored;
+    DEBUG_LOGF("Restored device from flash into slot %d\n", slot);
+  } else {
+    contact.used = true;
+    memcpy(contact.address, deviceAddress, MAC_ADDRESS_LENGTH);
+    contact.firstSeenTime = currentTime;
+    contact.closeContactDuration = 0;
+    contact.lastCloseContactTime = 0;
+    contact.windowBucket = currentTime / EXPOSURE_BUCKET_SECONDS;
+    contact.windowCloseTime = 0;
+    memset(contact.windowCloseSeconds, 0, sizeof(contact.windowCloseSeconds));
+    contact.logged = false;
+    contact.exposed = false;
+    contact.exposureLogged = false;
+    contact.filteredRssi = 0;
+    contact.lastRecordTime = 0;
+    DEBUG_LOGF("Started tracking device in slot %d\n", slot);
+  }
+  contact.used = true;
+  contact.lastSeenTime = currentTime;
+  contact.lastSeenBoot = bootCount;
+  return slot;
+}
+
+int addOrUpdateTrackedDevice(const uint8_t* deviceAddress, unsigned long currentTime) {
+  bool seenThisBoot, filterStale;
+  return trackDevice(deviceAddress, currentTime, seenThisBoot, filterStale);
+}
+
+// How long have we been in close contact with this device?
+unsigned long getCloseContactDuration(int slot) {
+  return (slot >= 0) ? trackedDevices[slot].closeContactDuration : 0;
+}
+
+// And how much of that in the last EXPOSURE_WINDOW_SECONDS
+unsigned long getWindowCloseTime(int slot) {
+  return (slot >= 0) ? trackedDevices[slot].windowCloseTime : 0;
+}
+
+// The close time the exposure definition counts
+unsigned long getExposureCloseTime(int slot) {
+  return trackerConfig.exposureWindowed ? getWindowCloseTime(slot) : getCloseContactDuration(slot);
+}
+
+// Move the window's newest bucket up to a time, emptying the buckets that fall out
+void advanceExposureWindow(TrackedContact& contact, unsigned long time) {
+  uint32_t bucket = time / EXPOSURE_BUCKET_SECONDS;
+  if (bucket <= contact.windowBucket) return; // Same bucket, or the clock went back
+  if (bucket - contact.windowBucket >= EXPOSURE_WINDOW_BUCKETS) {
+    memset(contact.windowCloseSeconds, 0, sizeof(contact.windowCloseSeconds));
+    contact.windowCloseTime = 0;
+  } else {
+    for (uint32_t next = contact.windowBucket + 1; next <= bucket; next++) {
+      uint8_t& expired = contact.windowCloseSeconds[next % EXPOSURE_WINDOW_BUCKETS];
+      contact.windowCloseTime -= expired;
+      expired = 0;
+    }
+  }
+  contact.windowBucket = bucket;
+}
+
+// Count close time from one scan to the next into the total and the window buckets
+void addCloseTime(TrackedContact& contact, unsigned long from, unsigned long to) {
+  if (to <= from) return;
+  contact.closeContactDuration += to - from;
+  if (to - from > EXPOSURE_WINDOW_SECONDS) {
+    from = to - EXPOSURE_WINDOW_SECONDS; // The rest already fell out of the window
+  }
+  while (from < to) {
+    unsigned long bucketEnd = (from / EXPOSURE_BUCKET_SECONDS + 1) * EXPOSURE_BUCKET_SECONDS;
+    unsigned long end = (bucketEnd < to) ? bucketEnd : to;
+    advanceExposureWindow(contact, from);
+    contact.windowCloseSeconds[contact.windowBucket % EXPOSURE_WINDOW_BUCKETS] += end - from;
+    contact.windowCloseTime += end - from;
+    from = end;
+  }
+}
+
+// RSSI expected at a distance under the log-distance path loss model, in filter units
+int rssiAtDistance(float meters) {
+  return (int)((trackerConfig.pathLossRssiAt1m - 10 * trackerConfig.pathLossExponent * log10f(meters)) * RSSI_FILTER_SCALE);
+}
+
+// Hysteresis band, a peer hovering around one distance doesn't flap in and out
+TRACKER_THREAD_LOCAL int closeContactEnterRssi = rssiAtDistance(CLOSE_CONTACT_ENTER_DISTANCE);
+TRACKER_THREAD_LOCAL int closeContactExitRssi = rssiAtDistance(CLOSE_CONTACT_EXIT_DISTANCE);
+
+void setTrackerConfig(const TrackerConfig& config) {
+  trackerConfig = config;
+  closeContactEnterRssi = rssiAtDistance(config.closeContactEnterDistance);
+  closeContactExitRssi = rssiAtDistance(config.closeContactExitDistance);
+}
+
+// Fold a sample into the peer's EWMA, the first one seeds it
+void updateRssiFilter(int slot, int rssi) {
+  if (slot < 0) return;
+  TrackedContact& contact = trackedDevices[slot];
+  int sample = rssi * RSSI_FILTER_SCALE;
+  if (contact.filteredRssi == 0) {
+    contact.filteredRssi = sample;
+  } else {
+    contact.filteredRssi += (sample - contact.filteredRssi) / (1 << trackerConfig.rssiFilterShift);
+  }
+}
+
+// Smoothed RSSI in whole dBm
+int getFilteredRssi(int slot) {
+  if (slot < 0) return MIN_RSSI;
+  int filtered = trackedDevices[slot].filteredRssi;
+  return (filtered - RSSI_FILTER_SCALE / 2) / RSSI_FILTER_SCALE; // Round, the value is negative
+}
+
+// Distance in meters the path loss model puts a filtered RSSI at
+float estimateDistance(int filteredRssi) {
+  float rssi = (float)filteredRssi / RSSI_FILTER_SCALE;
+  return powf(10, (trackerConfig.pathLossRssiAt1m - rssi) / (10 * trackerConfig.pathLossExponent));
+}
+
+// Update close contact tracking based on the filtered signal strength and bring the
+// close time and exposure status up to date, returns true when the device just got
+// close or moved away
+bool updateCloseContact(int slot, unsigned long currentTime, int filteredRssi) {
+  if (slot < 0) return false;
+  TrackedContact& contact = trackedDevices[slot];
+  
+  // Getting within ~1.5m starts a close contact, it lasts until the peer is past ~2.5m
+  bool wasInCloseContact = (contact.lastCloseContactTime > 0);
+  int threshold = wasInCloseContact ? closeContactExitRssi : closeContactEnterRssi;
+  bool isCloseContact = (filteredRssi >= threshold);
+
+  // Still close since the last scan counts until now, whatever this scan says
+  if (wasInCloseContact) {
+    addCloseTime(contact, contact.lastCloseContactTime, currentTime);
+  }
+  advanceExposureWindow(contact, currentTime);
+  contact.exposed = getExposureCloseTime(slot) >= trackerConfig.exposureTimeThreshold;
+  
+  bool changed = isCloseContact != wasInCloseContact;
+  if (isCloseContact) {
+    contact.lastCloseContactTime = currentTime; // Starts or keeps timing
+  } else if (wasInCloseContact) {
+    // Moved away
+    contact.lastCloseContactTime = 0;
+    
+    DEBUG_LOG("Close contact ended. ");
+    DEBUG_LOG(contact.closeContactDuration);
+    DEBUG_LOG(" seconds close in total for device in slot ");
+    DEBUG_LOGN(slot);
+  }
+  return changed;
+}
+
+// Check if this counts as a potential exposure event, as of the last updateCloseContact()
+bool isExposureEvent(int slot) {
+  return slot >= 0 && trackedDevices[slot].exposed;
+}
+
+int recordSighting(const uint8_t* deviceAddress, int rssi, unsigned long currentTime, bool& newThisBoot) {
+  int slot = findTrackedDevice(deviceAddress);
+  if (wasSeenThisBoot(slot)) {
+    newThisBoot = false;
+    updateRssiFilter(slot, rssi);
+    return slot;
+  }
+
+  // A peer evicted earlier in this scan comes back with its filter and isn't new. Samples
+  // from before the last scan say little about where the peer is now.
+  bool seenThisBoot, filterStale;
+  slot = trackDevice(deviceAddress, currentTime, seenThisBoot, filterStale);
+  newThisBoot = !seenThisBoot;
+  if (slot >= 0 && filterStale) {
+    trackedDevices[slot].filteredRssi = 0;
+  }
+  updateRssiFilter(slot, rssi);
+  return slot;
+}
+
+bool evaluateContact(int slot, unsigned long currentTime, ContactUpdate& update) {
+  if (slot < 0) return false;
+  TrackedContact& contact = trackedDevices[slot];
+  update.rssi = getFilteredRssi(slot);
+
+  // Update close contact tracking
+  bool closeContactChanged = updateCloseContact(slot, currentTime, contact.filteredRssi);
+
+  update.contactDuration = currentTime - getFirstSeenTime(slot);
+  update.closeContactDuration = getCloseContactDuration(slot);
+  update.windowCloseTime = getWindowCloseTime(slot);
+  update.isExposure = isExposureEvent(slot);
+
+  // Work out what this scan tells the server, most important first
+  update.event = LOG_EVENT_SIGHTING;
+  if (update.isExposure != contact.exposureLogged) {
+    update.event = LOG_EVENT_EXPOSURE;
+  } else if (closeContactChanged) {
+    update.event = (contact.lastCloseContactTime > 0) ? LOG_EVENT_CLOSE_START : LOG_EVENT_CLOSE_END;
+  } else if (!contact.logged) {
+    update.event = LOG_EVENT_FIRST_SEEN;
+  } else if (currentTime - contact.lastRecordTime >= trackerConfig.logSummaryInterval) {
+    update.event = LOG_EVENT_SUMMARY;
+  } else if (trackerConfig.logEventsOnly) {
+    return false; // Nothing changed since its last record
+  }
+  contact.logged = true;
+  contact.exposureLogged = update.isExposure;
+  contact.lastRecordTime = currentTime;
+  return true;
+}
+
+// Binary log record encoding (see constants.h for the layout)
+
+// Write a LEB128 varint, returns bytes used (at most 5)
+size_t putVarint(uint8_t* out, uint32_t value) {
+  size_t length = 0;
+  while (value >= 0x80) {
+    out[length++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[length++] = value;
+  return length;
+}
+
+size_t putUint32(uint8_t* out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = (value >> (8 * i)) & 0xFF;
+  }
+  return 4;
+}
+
+// Session record: opens each boot's run of contacts and anchors the time deltas
+size_t encodeSessionRecord(uint8_t* out, uint32_t startTime, uint32_t deviceId, uint32_t uploadDuration) {
+  size_t length = 0;
+  out[length++] = LOG_RECORD_SESSION;
+  length += putUint32(out + length, startTime);
+  length += putUint32(out + length, deviceId);
+  length += putVarint(out + length, uploadDuration);
+  return length;
+}
+
+size_t encodeContactRecord(uint8_t* out, const uint8_t* peerAddress, int rssi, uint32_t timeDelta,
+                           uint32_t contactDuration, uint32_t closeContactDuration, bool isExposure, uint8_t event) {
+  size_t length = 0;
+  out[length++] = LOG_RECORD_CONTACT | (event << LOG_EVENT_SHIFT) | (isExposure ? LOG_FLAG_EXPOSURE : 0);
+  memcpy(out + length, peerAddress, MAC_ADDRESS_LENGTH);
+  length += MAC_ADDRESS_LENGTH;
+  out[length++] = (uint8_t)(int8_t)(rssi < -128 ? -128 : (rssi > 127 ? 127 : rssi));
+  length += putVarint(out + length, timeDelta);
+  length += putVarint(out + length, contactDuration);
+  length += putVarint(out + length, closeContactDuration);
+  return length;
+}
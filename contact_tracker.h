@@ -0,0 +1,144 @@
+// Contact and exposure engine: the tracked device table kept in RTC memory, the
+// RSSI filter and distance model, close contact / exposure detection, the choice of
+// what gets logged and the binary record encoding. Plain C++ with no Arduino, BLE or
+// SPIFFS calls, so the same code builds on a host for bench/.
+//
+// The firmware provides bootCount and the overflow hooks at link time
+// (spillTrackedDevice / restoreTrackedDevice over SPIFFS, recordEvictedContact into
+// its log); the bench provides in-memory ones. On a host all of the state is per thread, so the bench can run
+// a tracker per thread with a config of its own (see TrackerConfig).
+#ifndef CONTACT_TRACKER_H
+#define CONTACT_TRACKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "constants.h"
+
+#ifdef ARDUINO
+#include <esp_attr.h>
+#define TRACKER_THREAD_LOCAL
+#else
+#define RTC_DATA_ATTR
+#define TRACKER_THREAD_LOCAL thread_local
+#endif
+
+// Devices live in an open-addressed hash table keyed on the peer's binary ID (the
+// start of its rolling ID, MAC sized), so a lookup is one probe in the common case
+// instead of a strcmp per entry
+#define MAC_ADDRESS_LENGTH 6
+
+#if (TRACKED_TABLE_SIZE & (TRACKED_TABLE_SIZE - 1)) != 0 || TRACKED_TABLE_SIZE <= MAX_TRACKED_DEVICES
+#error "TRACKED_TABLE_SIZE must be a power of two larger than MAX_TRACKED_DEVICES"
+#endif
+
+#define EXPOSURE_BUCKET_SECONDS (EXPOSURE_WINDOW_SECONDS / EXPOSURE_WINDOW_BUCKETS)
+#if EXPOSURE_WINDOW_SECONDS % EXPOSURE_WINDOW_BUCKETS != 0 || EXPOSURE_BUCKET_SECONDS > 255
+#error "EXPOSURE_WINDOW_SECONDS must split into EXPOSURE_WINDOW_BUCKETS buckets of at most 255 seconds"
+#endif
+
+// Plain data, so the table survives deep sleep in RTC memory and spills to flash as is
+struct TrackedContact {
+    uint8_t address[MAC_ADDRESS_LENGTH]; // Peer ID, the start of its rolling ID
+    bool used;
+    bool logged; // Has a contact record been written for it yet
+    bool exposed; // Exposure status, kept up to date with the close time
+    bool exposureLogged; // Exposure status as of its last record
+    int16_t filteredRssi; // Smoothed RSSI in dBm * RSSI_FILTER_SCALE, 0 = no sample yet
+    uint32_t firstSeenTime;
+    uint32_t closeContactDuration; // How long we were close, counted up to lastCloseContactTime
+    uint32_t lastCloseContactTime; // When we last saw them close, 0 = not close now
+    uint32_t windowBucket; // Newest bucket of the rolling window (time / EXPOSURE_BUCKET_SECONDS)
+    uint16_t windowCloseTime; // Sum of windowCloseSeconds
+    uint8_t windowCloseSeconds[EXPOSURE_WINDOW_BUCKETS]; // Close seconds per bucket, a ring
+    uint32_t lastSeenTime; // For least recently seen eviction
+    uint32_t lastSeenBoot; // bootCount of the last scan that saw them
+    uint32_t lastRecordTime; // When its last contact record was written
+};
+
+extern TRACKER_THREAD_LOCAL TrackedContact trackedDevices[TRACKED_TABLE_SIZE];
+extern TRACKER_THREAD_LOCAL int trackedDeviceCount;
+
+// Peers evicted to the overflow store (OVERFLOW_FILE) when the RTC table is full. The
+// index keeps a tag of each record's MAC and when its peer was last seen, so a peer
+// that never overflowed costs no flash access and one that did costs a single read.
+// A full store reuses the record of the peer gone longest; if that one is younger
+// than OVERFLOW_EXPIRY_SECONDS its history is lost and counted in overflowDropCount.
+struct OverflowEntry {
+    uint16_t tag; // Of the MAC, 0 = free position
+    uint16_t lastSeenMinute; // Wraps, only compared as a difference
+};
+
+extern TRACKER_THREAD_LOCAL OverflowEntry overflowIndex[MAX_OVERFLOW_DEVICES];
+extern TRACKER_THREAD_LOCAL int overflowDeviceCount;
+extern TRACKER_THREAD_LOCAL uint32_t overflowDropCount; // Since the firmware last reset it (each upload)
+
+// The tunables of the distance model, close contact and exposure definition and
+// logging, constants.h by default. The firmware never changes them, the bench
+// replays recordings under many of them (bench/tracker_tune.cpp).
+struct TrackerConfig {
+    float pathLossRssiAt1m = PATH_LOSS_RSSI_AT_1M;
+    float pathLossExponent = PATH_LOSS_EXPONENT;
+    float closeContactEnterDistance = CLOSE_CONTACT_ENTER_DISTANCE;
+    float closeContactExitDistance = CLOSE_CONTACT_EXIT_DISTANCE;
+    int rssiFilterShift = RSSI_FILTER_SHIFT; // 0 = no smoothing
+    uint32_t exposureTimeThreshold = EXPOSURE_TIME_THRESHOLD;
+    bool exposureWindowed = EXPOSURE_WINDOWED;
+    bool logEventsOnly = LOG_EVENTS_ONLY;
+    uint32_t logSummaryInterval = LOG_SUMMARY_INTERVAL;
+};
+
+extern TRACKER_THREAD_LOCAL TrackerConfig trackerConfig;
+void setTrackerConfig(const TrackerConfig& config); // Between replays, not while peers are tracked
+
+// Provided by the firmware (or the bench)
+extern TRACKER_THREAD_LOCAL unsigned long bootCount;
+bool spillTrackedDevice(int position, const TrackedContact& contact); // Keep an evicted device at a record position
+// And read it back, false unless the record there is that device's
+bool restoreTrackedDevice(int position, const uint8_t* deviceAddress, TrackedContact& contact);
+// A peer this boot's scan saw is about to be evicted: evaluate and log it now, the
+// end of scan pass only covers the peers still in the table
+void recordEvictedContact(int slot, unsigned long currentTime);
+
+// Helper functions for device tracking
+// Lookups return a slot handle (-1 if not tracked) that the other helpers take directly.
+// Handles stay valid until the next addOrUpdateTrackedDevice() call, which may evict.
+int findTrackedDevice(const uint8_t* deviceAddress);
+unsigned long getFirstSeenTime(int slot);
+bool wasSeenThisBoot(int slot);
+int addOrUpdateTrackedDevice(const uint8_t* deviceAddress, unsigned long currentTime);
+unsigned long getCloseContactDuration(int slot);
+unsigned long getWindowCloseTime(int slot);
+unsigned long getExposureCloseTime(int slot);
+void updateRssiFilter(int slot, int rssi);
+int getFilteredRssi(int slot);
+float estimateDistance(int filteredRssi);
+bool updateCloseContact(int slot, unsigned long currentTime, int filteredRssi);
+bool isExposureEvent(int slot);
+
+// Count one advertisement towards its peer. Every one goes into the RSSI filter, the
+// first one per boot also (re)starts tracking the peer. Returns the slot (-1 if the
+// table couldn't take it), newThisBoot tells whether this was that first one.
+int recordSighting(const uint8_t* deviceAddress, int rssi, unsigned long currentTime, bool& newThisBoot);
+
+// What a scan learned about one peer
+struct ContactUpdate {
+    int rssi; // Filtered, whole dBm
+    uint32_t contactDuration;
+    uint32_t closeContactDuration; // Including a close contact still going on
+    uint32_t windowCloseTime; // Of that, how much in the last EXPOSURE_WINDOW_SECONDS
+    bool isExposure;
+    uint8_t event; // LOG_EVENT_*
+};
+
+// Update close contact and exposure from the peer's filtered RSSI. Returns true if the
+// result is worth a contact record (see LOG_EVENTS_ONLY), which the peer then counts as logged.
+bool evaluateContact(int slot, unsigned long currentTime, ContactUpdate& update);
+
+// Binary log record encoding (see constants.h for the layout)
+size_t putVarint(uint8_t* out, uint32_t value);
+size_t putUint32(uint8_t* out, uint32_t value);
+size_t encodeSessionRecord(uint8_t* out, uint32_t startTime, uint32_t deviceId, uint32_t uploadDuration);
+size_t encodeContactRecord(uint8_t* out, const uint8_t* peerAddress, int rssi, uint32_t timeDelta,
+                           uint32_t contactDuration, uint32_t closeContactDuration, bool isExposure, uint8_t event);
+
+#endif // !CONTACT_TRACKER_H
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Fit the log-distance path loss model used by the firmware to the calibration CSVs.
+
+    rssi = PATH_LOSS_RSSI_AT_1M - 10 * PATH_LOSS_EXPONENT * log10(distance)
+
+Every CSV under data/ named like "2m_device_..._data_o.csv" is one run at that
+distance. Prints the fitted constants for constants.h, then replays each run
+through the raw threshold and through the firmware's EWMA + hysteresis to show
+how many close contact transitions each would log.
+
+Usage: python3 data/analysis_scripts/fit_path_loss.py [data dir]
+"""
+import csv
+import glob
+import math
+import os
+import re
+import sys
+
+# Keep in sync with constants.h
+RSSI_FILTER_SHIFT = 2
+CLOSE_CONTACT_ENTER_DISTANCE = 1.5
+CLOSE_CONTACT_EXIT_DISTANCE = 2.5
+OLD_CLOSE_CONTACT_RSSI = -60
+
+
+def load_runs(data_dir):
+    runs = []
+    for path in sorted(glob.glob(os.path.join(data_dir, '**', '*m_device_*.csv'), recursive=True)):
+        distance = int(re.match(r'(\d+)m_', os.path.basename(path)).group(1))
+        samples = []
+        with open(path, newline='') as f:
+            for row in csv.reader(f):
+                try:
+                    samples.append(int(row[2]))
+                except (IndexError, ValueError):
+                    continue  # Header or comment line
+        if samples:
+            runs.append((path, distance, samples))
+    return runs
+
+
+def fit(runs):
+    xs = [math.log10(d) for _, d, samples in runs for _ in samples]
+    ys = [r for _, _, samples in runs for r in samples]
+    mean_x = sum(xs) / len(xs)
+    mean_y = sum(ys) / len(ys)
+    slope = sum((x - mean_x) * (y - mean_y) for x, y in zip(xs, ys)) / sum((x - mean_x) ** 2 for x in xs)
+    rssi_at_1m = mean_y - slope * mean_x
+    residual = math.sqrt(sum((y - rssi_at_1m - slope * x) ** 2 for x, y in zip(xs, ys)) / len(xs))
+    return rssi_at_1m, -slope / 10, residual, len(xs)
+
+
+def transitions_raw(samples):
+    close = [r >= OLD_CLOSE_CONTACT_RSSI for r in samples]
+    return sum(a != b for a, b in zip(close, close[1:]))
+
+
+def transitions_filtered(samples, enter_rssi, exit_rssi):
+    filtered = samples[0]
+    close = filtered >= enter_rssi
+    count = 0
+    for r in samples[1:]:
+        filtered += (r - filtered) / (1 << RSSI_FILTER_SHIFT)
+        now_close = filtered >= (exit_rssi if close else enter_rssi)
+        count += now_close != close
+        close = now_close
+    return count
+
+
+def main():
+    data_dir = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), '..')
+    runs = load_runs(data_dir)
+    if not runs:
+        sys.exit(f'No calibration CSVs found under {data_dir}')
+
+    rssi_at_1m, exponent, residual, count = fit(runs)
+    print(f'{count} samples from {len(runs)} runs, residual {residual:.1f} dB')
+    print(f'#define PATH_LOSS_RSSI_AT_1M {rssi_at_1m:.1f}')
+    print(f'#define PATH_LOSS_EXPONENT {exponent:.2f}')
+
+    def rssi_at(d):
+        return rssi_at_1m - 10 * exponent * math.log10(d)
+
+    enter_rssi = rssi_at(CLOSE_CONTACT_ENTER_DISTANCE)
+    exit_rssi = rssi_at(CLOSE_CONTACT_EXIT_DISTANCE)
+    print(f'Close contact enters at {enter_rssi:.1f} dBm, exits below {exit_rssi:.1f} dBm\n')
+
+    print(f'{"run":60} {"raw":>5} {"filtered":>9}')
+    total_raw = total_filtered = 0
+    for path, _, samples in runs:
+        raw = transitions_raw(samples)
+        filtered = transitions_filtered(samples, enter_rssi, exit_rssi)
+        total_raw += raw
+        total_filtered += filtered
+        print(f'{os.path.relpath(path, data_dir):60} {raw:5} {filtered:9}')
+    print(f'{"total close contact transitions":60} {total_raw:5} {total_filtered:9}')
+
+
+if __name__ == '__main__':
+    main()
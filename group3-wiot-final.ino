@@ -2,199 +2,923 @@
 // Scans for nearby Bluetooth devices and tracks contact exposure
 #include <constants.h>
 #include <secrets.h>
+#include <contact_tracker.h>
+#include <lzss.h>
 #include <WiFi.h>
 #include <WiFiUdp.h>
 #include <time.h>
+#include <atomic>
+#include <esp_sntp.h>
+#include <esp_timer.h>
+#include <esp_sleep.h>
+#include <esp_wake_stub.h>
+#include <mbedtls/md.h>
 #include <SPIFFS.h>
 #include <BLEDevice.h>
 #include <BLEUtils.h>
 #include <BLEScan.h>
 #include <BLEAdvertisedDevice.h>
+#include <esp_gap_ble_api.h>
 
 // WiFi upload settings
 #define RETRY_COUNTER 3
 #define ACK_TIMEOUT 5000 // 5 seconds
+#define WIFI_CONNECT_TIMEOUT 10000 // ms for a full scan + DHCP connect
+#define WIFI_FAST_CONNECT 1 // Reuse the cached BSSID/channel/IP to skip the scan and DHCP
+#define WIFI_FAST_CONNECT_TIMEOUT 3000 // ms before falling back to a full connect
+
+// Chunked upload datagrams: "CU", type, flags, uint32 stream ID, uint32 byte offset, payload.
+// BEGIN carries uint32 total length, uint16 chunk size + text header, DATA carries log bytes
+// at offset, END carries the total length as its offset. The server answers
+// "ACK <next offset> <sack hex>", where SACK bit i means it already holds the chunk
+// starting i chunks past the next offset, or "RST" if it doesn't know the stream.
+// A BEGIN flagged UPLOAD_FLAG_LZSS offers compressed chunks; a server that takes them
+// adds " lzss" to its answer, and from then on DATA packets flagged UPLOAD_FLAG_LZSS carry
+// their chunk LZSS compressed (see lzss.h). Offsets and SACKs still count raw bytes.
+// UPLOAD_HEADER_SIZE and UPLOAD_CHUNK_SIZE are in constants.h, the bench sizes uploads by them.
+#define UPLOAD_MAGIC "CU"
+#define UPLOAD_BEGIN_SIZE 6
+#define UPLOAD_WINDOW_SIZE 4 // Chunks in flight before waiting for ACKs
+#define UPLOAD_INITIAL_RTO 1000 // ms, until we have an RTT sample
+#define UPLOAD_MIN_RTO 100 // ms
+#define UPLOAD_BEGIN 'B'
+#define UPLOAD_DATA 'D'
+#define UPLOAD_END 'E'
+#define UPLOAD_FLAG_LZSS 0x01
+#define UPLOAD_COMPRESSION 1 // Offer LZSS compressed chunks, 0 = always send them raw
+
+#if UPLOAD_CHUNK_SIZE > LZSS_MAX_INPUT
+#error "UPLOAD_CHUNK_SIZE must fit the LZSS hash chains"
+#endif
+
+// Fills buffer with upload stream bytes starting at offset, returns how many it read
+typedef size_t (*UploadReader)(uint32_t offset, uint8_t* buffer, size_t length);
 
 // Keep track of boot cycles and performance stats
 RTC_DATA_ATTR unsigned long bootCount = 0;
 RTC_DATA_ATTR unsigned long lastUploadDuration = 0;
 
-// Memory to remember devices between sleep cycles
-#define MAX_TRACKED_DEVICES 10
-RTC_DATA_ATTR char trackedDevices[MAX_TRACKED_DEVICES][18]; // MAC addresses
-RTC_DATA_ATTR unsigned long firstSeenTimes[MAX_TRACKED_DEVICES];
-RTC_DATA_ATTR unsigned long closeContactDurations[MAX_TRACKED_DEVICES]; // How long we were close
-RTC_DATA_ATTR unsigned long lastCloseContactTimes[MAX_TRACKED_DEVICES]; // When we last saw them close
-RTC_DATA_ATTR int trackedDeviceCount = 0;
-
-// Helper functions for device tracking
-int findTrackedDevice(const char* deviceAddress);
-unsigned long getFirstSeenTime(const char* deviceAddress);
-void addOrUpdateTrackedDevice(const char* deviceAddress, unsigned long currentTime);
-unsigned long getCloseContactDuration(const char* deviceAddress);
-void updateCloseContact(const char* deviceAddress, unsigned long currentTime, int rssi);
-bool isExposureEvent(const char* deviceAddress, unsigned long currentTime);
+// Key the rolling IDs of one day are derived from (see ROLLING_ID_INTERVAL)
+RTC_DATA_ATTR uint8_t dailyKey[32];
+RTC_DATA_ATTR bool dailyKeyValid = false;
+RTC_DATA_ATTR uint32_t dailyKeyDay = 0; // Unix day number
+
+// Upload progress, so a failed upload resumes instead of starting over
+RTC_DATA_ATTR uint32_t uploadStreamId = 0;
+RTC_DATA_ATTR uint32_t uploadAckedOffset = 0;
+
+// Upload policy state (see UPLOAD_PENDING_BYTES etc.), times from the RTC clock
+RTC_DATA_ATTR time_t oldestPendingTime = 0; // When the oldest not yet uploaded record was logged, 0 = none
+RTC_DATA_ATTR bool exposurePending = false; // An exposure was logged since the last upload
+RTC_DATA_ATTR uint8_t uploadFailures = 0; // In a row
+RTC_DATA_ATTR time_t nextUploadAttempt = 0; // Backoff after a failure
+
+// Contact log positions (see LOG_SEGMENT_* in constants.h), rebuilt from flash after a reset
+RTC_DATA_ATTR uint32_t logCommitPosition = 0; // Everything before this was uploaded
+RTC_DATA_ATTR uint32_t logHeadPosition = 0; // End of what's written to flash
+
+// Smoothed upload round-trip time (ms), carried over so each upload starts with a good timeout
+RTC_DATA_ATTR uint32_t uploadSmoothedRtt = 0;
+RTC_DATA_ATTR uint32_t uploadRttVariance = 0;
+
+// Upload buffers live outside the stack
+uint8_t uploadPacket[UPLOAD_HEADER_SIZE + UPLOAD_CHUNK_SIZE];
+uint8_t uploadWindow[UPLOAD_WINDOW_SIZE][UPLOAD_CHUNK_SIZE];
+
+// Last good WiFi association, reused to skip the channel scan and DHCP
+struct WifiConnectionCache {
+    bool valid;
+    uint8_t bssid[6];
+    int32_t channel;
+    uint32_t localIP;
+    uint32_t gatewayIP;
+    uint32_t subnetMask;
+    uint32_t dnsIP;
+};
+RTC_DATA_ATTR WifiConnectionCache wifiCache;
+
+// Sleep scheduling state (see MIN/MAX_SLEEP_TIME_SECONDS and ENERGY_BUDGET_MAH_PER_DAY)
+#define ENERGY_BUDGET_UA (ENERGY_BUDGET_MAH_PER_DAY * 1000 / 24) // Average current the budget allows
+#if ENERGY_BUDGET_UA <= SLEEP_CURRENT_UA
+#error "ENERGY_BUDGET_MAH_PER_DAY must allow more than the deep sleep current"
+#endif
+RTC_DATA_ATTR uint32_t sleepInterval = SLEEP_TIME_SECONDS; // Seconds, of the sleep that just ended
+RTC_DATA_ATTR int32_t energyCredit = ENERGY_BUDGET_UA * ENERGY_CREDIT_SECONDS; // uAs left to spend above the budget
+RTC_DATA_ATTR uint32_t wakeStubSkips = 0; // Ticks of the current sleep the wake stub still sleeps through
+
+// Wall clock state, system time itself keeps running on the RTC during deep sleep
+RTC_DATA_ATTR time_t lastTimeSync = 0; // Unix time of the last NTP sync, 0 = never synced
+RTC_DATA_ATTR int32_t clockDriftPpm = DEFAULT_CLOCK_DRIFT_PPM; // Measured at each resync
+
+// Where each boot's time and charge go (see BOOT_STATS_RING_SIZE)
+enum BootPhase {
+    PHASE_OTHER, // Anything outside the phases below
+    PHASE_STORAGE,
+    PHASE_WIFI_CONNECT,
+    PHASE_NTP,
+    PHASE_BLE_INIT,
+    PHASE_SCAN,
+    PHASE_PROCESSING,
+    PHASE_FLASH_WRITE,
+    PHASE_UPLOAD,
+    PHASE_SLEEP_ENTRY,
+    PHASE_COUNT
+};
+
+const char* const phaseNames[PHASE_COUNT] = {
+    "other", "storage", "wifi_connect", "ntp", "ble_init", "scan", "processing", "flash_write", "upload", "sleep_entry"
+};
+const uint16_t phaseCurrentMa[PHASE_COUNT] = {
+    PHASE_CURRENT_OTHER_MA, PHASE_CURRENT_STORAGE_MA, PHASE_CURRENT_WIFI_CONNECT_MA, PHASE_CURRENT_NTP_MA,
+    PHASE_CURRENT_BLE_INIT_MA, PHASE_CURRENT_SCAN_MA, PHASE_CURRENT_PROCESSING_MA, PHASE_CURRENT_FLASH_WRITE_MA,
+    PHASE_CURRENT_UPLOAD_MA, PHASE_CURRENT_SLEEP_ENTRY_MA
+};
+
+struct BootStats {
+    uint32_t bootCount;
+    uint32_t sleepSeconds; // The sleep that followed
+    uint32_t phaseMicros[PHASE_COUNT];
+};
+RTC_DATA_ATTR BootStats bootStatsRing[BOOT_STATS_RING_SIZE];
+RTC_DATA_ATTR uint8_t bootStatsCount = 0;
+RTC_DATA_ATTR uint8_t bootStatsNext = 0;
+
+// Times this boot's phases. esp_timer starts counting at boot, so PHASE_OTHER gets the bootloader too.
+class BootPhaseTimer {
+private:
+    BootStats _stats;
+    int _phase;
+    int64_t _phaseStart;
+    TaskHandle_t _owner; // The task running setup(), the first to switch
+
+public:
+    BootPhaseTimer() : _phase(PHASE_OTHER), _phaseStart(0), _owner(nullptr) {
+        memset(&_stats, 0, sizeof(_stats));
+    }
+
+    // Charge the time since the last switch to the running phase and move on to another.
+    // Returns the phase it interrupted, phases nest by switching back to it.
+    // Only the main task switches; work on the storage task (STORAGE_TASK) counts
+    // towards whatever phase the main task is in meanwhile.
+    int switchTo(int phase) {
+        if (_owner == nullptr) {
+            _owner = xTaskGetCurrentTaskHandle();
+        } else if (xTaskGetCurrentTaskHandle() != _owner) {
+            return _phase;
+        }
+        int64_t now = esp_timer_get_time();
+        _stats.phaseMicros[_phase] += now - _phaseStart;
+        _phaseStart = now;
+        int previous = _phase;
+        _phase = phase;
+        return previous;
+    }
+
+    // Estimated charge of a phase in uAs
+    static uint32_t getPhaseCharge(int phase, uint32_t micros) {
+        return (uint64_t)micros * phaseCurrentMa[phase] / 1000;
+    }
+
+    // Estimated charge of this boot so far in uAs
+    uint32_t getBootCharge() {
+        switchTo(_phase);
+        uint32_t charge = 0;
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            charge += getPhaseCharge(i, _stats.phaseMicros[i]);
+        }
+        return charge;
+    }
+
+    // Keep this boot's stats, right before going to sleep
+    void save(uint32_t sleepSeconds) {
+        switchTo(_phase);
+        _stats.bootCount = bootCount;
+        _stats.sleepSeconds = sleepSeconds;
+        bootStatsRing[bootStatsNext] = _stats;
+        bootStatsNext = (bootStatsNext + 1) % BOOT_STATS_RING_SIZE;
+        if (bootStatsCount < BOOT_STATS_RING_SIZE) {
+            bootStatsCount++;
+        }
+    }
+
+    // "# Boot Stats: boots=<n> first=<boot> sleep=<s>s dropped=<peers> <phase>=<us>us/<uAs>uAs ..."
+    // summed over the boots kept since the last upload, dropped = overflowDropCount
+    static size_t format(char* out, size_t size) {
+        if (bootStatsCount == 0) {
+            out[0] = '\0';
+            return 0;
+        }
+
+        BootStats total;
+        memset(&total, 0, sizeof(total));
+        uint8_t first = (bootStatsNext + BOOT_STATS_RING_SIZE - bootStatsCount) % BOOT_STATS_RING_SIZE;
+        for (int i = 0; i < bootStatsCount; i++) {
+            const BootStats& stats = bootStatsRing[(first + i) % BOOT_STATS_RING_SIZE];
+            total.sleepSeconds += stats.sleepSeconds;
+            for (int phase = 0; phase < PHASE_COUNT; phase++) {
+                total.phaseMicros[phase] += stats.phaseMicros[phase];
+            }
+        }
+
+        size_t length = snprintf(out, size, "# Boot Stats: boots=%u first=%lu sleep=%lus dropped=%lu", bootStatsCount,
+                                 (unsigned long)bootStatsRing[first].bootCount, (unsigned long)total.sleepSeconds,
+                                 (unsigned long)overflowDropCount);
+        for (int phase = 0; phase < PHASE_COUNT && length < size; phase++) {
+            length += snprintf(out + length, size - length, " %s=%luus/%luuAs", phaseNames[phase],
+                               (unsigned long)total.phaseMicros[phase],
+                               (unsigned long)getPhaseCharge(phase, total.phaseMicros[phase]));
+        }
+        if (length < size) {
+            length += snprintf(out + length, size - length, "\n");
+        }
+        return min(length, size - 1);
+    }
+};
+BootPhaseTimer phaseTimer;
 
 // Handles WiFi connection and data uploads
 class WifiDataSender {
 private:
     const char* _ssid;
     const char* _password;
-    const char* _udpAddress;
+    const char* _udpAddress; // IP or DNS name of an ingest gateway
+    IPAddress _udpServer; // _udpAddress resolved for this upload
     unsigned int _udpPort;
     WiFiUDP _udp;
     bool _packetAcknowledged;
     uint8_t _retryCounter;
     bool _debug;
 
-    void _connectToWiFi() {
-        WiFi.mode(WIFI_STA);
-        DEBUG_LOGN("-- LOG: Connecting to WiFi...");
-        WiFi.begin(_ssid, _password);
-
-        unsigned long timeout = millis() + 10000; // Give it 10 seconds max to connect
+    bool _waitForConnection(unsigned long timeoutMs) {
+        unsigned long timeout = millis() + timeoutMs;
 
         while (WiFi.status() != WL_CONNECTED && millis() < timeout) {
             delay(100);
             DEBUG_LOG(".");
         }
+        return WiFi.status() == WL_CONNECTED;
+    }
+
+    // Returns false if no access point took us, callers give up without touching the network
+    bool _connectToWiFi() {
+        int previousPhase = phaseTimer.switchTo(PHASE_WIFI_CONNECT);
+        WiFi.persistent(false); // Don't rewrite the credentials to NVS on every connect
+        WiFi.mode(WIFI_STA);
+        bool connected = false;
+
+#if WIFI_FAST_CONNECT
+        // Straight to the known access point with the old lease, no scan or DHCP
+        if (wifiCache.valid) {
+            DEBUG_LOGN("-- LOG: Fast connecting to WiFi...");
+            WiFi.config(IPAddress(wifiCache.localIP), IPAddress(wifiCache.gatewayIP),
+                        IPAddress(wifiCache.subnetMask), IPAddress(wifiCache.dnsIP));
+            WiFi.begin(_ssid, _password, wifiCache.channel, wifiCache.bssid);
+            connected = _waitForConnection(WIFI_FAST_CONNECT_TIMEOUT);
+
+            if (!connected) {
+                DEBUG_LOGN("\n-- LOG: Fast connect failed, doing a full connect");
+                wifiCache.valid = false;
+                WiFi.disconnect();
+                WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // Back to DHCP
+            }
+        }
+#endif
+
+        if (!connected) {
+            DEBUG_LOGN("-- LOG: Connecting to WiFi...");
+            WiFi.begin(_ssid, _password);
+            connected = _waitForConnection(WIFI_CONNECT_TIMEOUT); // Give it 10 seconds max to connect
+        }
 
-        if (WiFi.status() != WL_CONNECTED) {
+        if (!connected) {
             DEBUG_LOGN("\n-- ERROR: WiFi Connection Failed!!");
-            return;
+            phaseTimer.switchTo(previousPhase);
+            return false;
         }
 
         DEBUG_LOGN("\n-- SUCCESS: WiFi Connected!!");
         DEBUG_LOG("-- LOG: IP Address: ");
         DEBUG_LOGN(WiFi.localIP());
 
+        if (!wifiCache.valid) {
+            memcpy(wifiCache.bssid, WiFi.BSSID(), sizeof(wifiCache.bssid));
+            wifiCache.channel = WiFi.channel();
+            wifiCache.localIP = WiFi.localIP();
+            wifiCache.gatewayIP = WiFi.gatewayIP();
+            wifiCache.subnetMask = WiFi.subnetMask();
+            wifiCache.dnsIP = WiFi.dnsIP() ? (uint32_t)WiFi.dnsIP() : wifiCache.gatewayIP;
+            wifiCache.valid = true;
+        }
+
         _udp.begin(_udpPort);
+        phaseTimer.switchTo(previousPhase);
+        return true;
+    }
+
+    // A chunk in the send window
+    struct WindowSlot {
+        bool inUse;
+        bool compressed; // uploadWindow holds the chunk LZSS compressed, sentLength bytes of it
+        uint32_t offset;
+        size_t length; // Of the stream the chunk covers
+        size_t sentLength;
+        unsigned long sentAt;
+        uint32_t timeout;
+        uint8_t transmissions;
+    };
+    WindowSlot _slots[UPLOAD_WINDOW_SIZE];
+
+    // Retransmit timeout from the smoothed RTT (RFC 6298)
+    uint32_t _retransmitTimeout() {
+        if (uploadSmoothedRtt == 0) {
+            return UPLOAD_INITIAL_RTO;
+        }
+        return constrain(uploadSmoothedRtt + 4 * uploadRttVariance, (uint32_t)UPLOAD_MIN_RTO, (uint32_t)ACK_TIMEOUT);
+    }
+
+    void _sampleRtt(uint32_t rtt) {
+        if (uploadSmoothedRtt == 0) {
+            uploadSmoothedRtt = rtt;
+            uploadRttVariance = rtt / 2;
+            return;
+        }
+        uint32_t error = (rtt > uploadSmoothedRtt) ? rtt - uploadSmoothedRtt : uploadSmoothedRtt - rtt;
+        uploadRttVariance = (3 * uploadRttVariance + error) / 4;
+        uploadSmoothedRtt = (7 * uploadSmoothedRtt + rtt) / 8;
     }
 
-    // Wait for server to confirm it got our data
-    bool waitForAcknowledgment() {
-        unsigned long timeout = millis() + ACK_TIMEOUT;
+    bool _streamReset; // Server answered RST, it no longer knows our stream
+    bool _serverLzss; // Last ACK said the server takes compressed chunks
+    bool _compressChunks; // This upload sends them
+    uint32_t _sentBytes; // DATA payload bytes sent, for the compression stats
+
+    // Wait for server to confirm it got our data, returns the offset it expects next
+    // and the bitmap of chunks past that offset it already holds
+    bool waitForAcknowledgment(uint32_t timeoutMs, uint32_t& ackOffset, uint32_t& sack) {
+        unsigned long timeout = millis() + timeoutMs;
         
         while (millis() < timeout) {
             int packetSize = _udp.parsePacket();
             if (packetSize > 0) {
-                char ackBuffer[4];
+                char ackBuffer[32];
                 int len = _udp.read(ackBuffer, sizeof(ackBuffer) - 1);
                 if (len > 0) {
                     ackBuffer[len] = '\0';
-                    if (strcmp(ackBuffer, "ACK") == 0) {
+                    if (strncmp(ackBuffer, "ACK ", 4) == 0) {
+                        char* end;
+                        ackOffset = strtoul(ackBuffer + 4, &end, 10);
+                        sack = strtoul(end, &end, 16);
+                        _serverLzss = strstr(end, "lzss") != nullptr;
+                        return true;
+                    }
+                    if (strcmp(ackBuffer, "RST") == 0) {
+                        _streamReset = true;
+                        ackOffset = 0;
+                        sack = 0;
                         return true;
                     }
                 }
             }
-            delay(10);
+            delay(1);
         }
         return false;
     }
 
-    // Try sending data multiple times if needed
-    bool _sendDataWithConfirmation(const char* data) {
+    // Fill in the datagram header
+    void _writeHeader(uint8_t* header, char type, uint32_t streamId, uint32_t offset, uint8_t flags = 0) {
+        memcpy(header, UPLOAD_MAGIC, 2);
+        header[2] = type;
+        header[3] = flags;
+        for (int i = 0; i < 4; i++) {
+            header[4 + i] = (streamId >> (8 * i)) & 0xFF;
+            header[8 + i] = (offset >> (8 * i)) & 0xFF;
+        }
+    }
+
+    // Try sending a control datagram (BEGIN/END) multiple times if needed
+    bool _sendDataWithConfirmation(size_t payloadLength, uint32_t& ackOffset) {
+        uint32_t timeout = _retransmitTimeout();
         for (_retryCounter = 1; _retryCounter <= RETRY_COUNTER; _retryCounter++) {
             // Send the UDP packet to server
-            _udp.beginPacket(_udpAddress, _udpPort);
-            _udp.print(data);
+            unsigned long sentAt = millis();
+            _udp.beginPacket(_udpServer, _udpPort);
+            _udp.write(uploadPacket, UPLOAD_HEADER_SIZE + payloadLength);
             _udp.endPacket();
 
             if (_debug) {
-                DEBUG_LOG("-- LOG: Sent packet #");
-                DEBUG_LOGN(_retryCounter);
+                DEBUG_LOGF("-- LOG: Sent %c packet #%u\n", uploadPacket[2], _retryCounter);
             }
 
             // Did server get it?
-            if (waitForAcknowledgment()) {
-                DEBUG_LOGN("-- SUCCESS: ACK Received!!");
+            uint32_t sack;
+            if (waitForAcknowledgment(timeout, ackOffset, sack)) {
+                if (_retryCounter == 1) {
+                    _sampleRtt(millis() - sentAt);
+                }
                 return true;
             }
             
             DEBUG_LOGN("-- LOG: ACK timeout, retrying...");
+            timeout = min(timeout * 2, (uint32_t)ACK_TIMEOUT);
         }
 
         DEBUG_LOGN("-- ERROR: Max retries exceeded!!");
         return false;
     }
 
+    void _sendChunk(int index, uint32_t streamId) {
+        WindowSlot& slot = _slots[index];
+        uint8_t header[UPLOAD_HEADER_SIZE];
+        _writeHeader(header, UPLOAD_DATA, streamId, slot.offset, slot.compressed ? UPLOAD_FLAG_LZSS : 0);
+        _udp.beginPacket(_udpServer, _udpPort);
+        _udp.write(header, UPLOAD_HEADER_SIZE);
+        _udp.write(uploadWindow[index], slot.sentLength);
+        _udp.endPacket();
+        _sentBytes += slot.sentLength;
+        slot.sentAt = millis();
+        slot.transmissions++;
+    }
+
+    // Sliding window over [offset, totalLength): keeps up to UPLOAD_WINDOW_SIZE chunks in
+    // flight, frees them on cumulative or selective ACKs and resends only what timed out
+    bool _sendWindow(UploadReader reader, uint32_t streamId, uint32_t offset, uint32_t totalLength, uint32_t& ackedOffset) {
+        memset(_slots, 0, sizeof(_slots));
+        uint32_t nextOffset = offset;
+
+        while (offset < totalLength) {
+            // Fill the window
+            for (int i = 0; i < UPLOAD_WINDOW_SIZE && nextOffset < totalLength; i++) {
+                if (_slots[i].inUse) continue;
+                WindowSlot& slot = _slots[i];
+                slot.length = reader(nextOffset, uploadWindow[i], min((uint32_t)UPLOAD_CHUNK_SIZE, totalLength - nextOffset));
+                if (slot.length == 0) {
+                    DEBUG_LOGN("-- ERROR: Failed to read upload chunk!");
+                    return false;
+                }
+                slot.inUse = true;
+                slot.compressed = false;
+                slot.sentLength = slot.length;
+                if (_compressChunks) {
+                    // uploadPacket is free while the window runs (it only carries BEGIN/END),
+                    // so it holds the compressed copy until it replaces the raw chunk
+                    uint8_t* packed = uploadPacket + UPLOAD_HEADER_SIZE;
+                    size_t packedLength = lzssCompress(uploadWindow[i], slot.length, packed, slot.length - 1);
+                    if (packedLength > 0) {
+                        memcpy(uploadWindow[i], packed, packedLength);
+                        slot.compressed = true;
+                        slot.sentLength = packedLength;
+                    }
+                }
+                slot.offset = nextOffset;
+                slot.transmissions = 0;
+                slot.timeout = _retransmitTimeout();
+                nextOffset += slot.length;
+                _sendChunk(i, streamId);
+            }
+
+            // Wait until the earliest chunk would time out
+            unsigned long now = millis();
+            uint32_t wait = ACK_TIMEOUT;
+            for (int i = 0; i < UPLOAD_WINDOW_SIZE; i++) {
+                if (!_slots[i].inUse) continue;
+                uint32_t elapsed = now - _slots[i].sentAt;
+                wait = min(wait, (elapsed < _slots[i].timeout) ? _slots[i].timeout - elapsed : 0);
+            }
+
+            uint32_t ackOffset, sack;
+            if (waitForAcknowledgment(wait, ackOffset, sack)) {
+                now = millis();
+                if (_streamReset) {
+                    // Server lost the stream, the next upload starts it over
+                    DEBUG_LOGN("-- ERROR: Server reset the upload stream!");
+                    ackedOffset = 0;
+                    return false;
+                }
+                if (ackOffset < offset || ackOffset > totalLength) {
+                    continue; // Stale or reordered ACK
+                }
+
+                for (int i = 0; i < UPLOAD_WINDOW_SIZE; i++) {
+                    WindowSlot& slot = _slots[i];
+                    if (!slot.inUse) continue;
+                    bool cumulative = slot.offset + slot.length <= ackOffset;
+                    uint32_t distance = (slot.offset - ackOffset) / UPLOAD_CHUNK_SIZE;
+                    bool selective = !cumulative && slot.offset >= ackOffset && distance < 32 && (sack & (1UL << distance));
+                    if (cumulative || selective) {
+                        if (slot.transmissions == 1) {
+                            _sampleRtt(now - slot.sentAt); // Karn: only unambiguous samples
+                        }
+                        slot.inUse = false;
+                    }
+                }
+                offset = ackOffset;
+                ackedOffset = offset;
+                continue;
+            }
+
+            // Resend whatever timed out, backing off its timeout
+            now = millis();
+            for (int i = 0; i < UPLOAD_WINDOW_SIZE; i++) {
+                WindowSlot& slot = _slots[i];
+                if (!slot.inUse || now - slot.sentAt < slot.timeout) continue;
+                if (slot.transmissions >= RETRY_COUNTER) {
+                    DEBUG_LOGN("-- ERROR: Max retries exceeded!!");
+                    return false;
+                }
+                DEBUG_LOGF("-- LOG: Chunk at %lu timed out, resending\n", (unsigned long)slot.offset);
+                slot.timeout = min(slot.timeout * 2, (uint32_t)ACK_TIMEOUT);
+                _sendChunk(i, streamId);
+            }
+        }
+        return true;
+    }
+
 public:
     WifiDataSender(const char* ssid, const char* password, const char* udpAddress, unsigned int udpPort, bool debug)
         : _ssid(ssid), _password(password), _udpAddress(udpAddress), _udpPort(udpPort),
-          _packetAcknowledged(false), _debug(debug), _retryCounter(0) {}
+          _packetAcknowledged(false), _debug(debug), _retryCounter(0), _streamReset(false),
+          _serverLzss(false), _compressChunks(false), _sentBytes(0) {}
+
+    // Drop the association and power the radio down, if it was ever brought up
+    void shutdown() {
+        if (WiFi.getMode() == WIFI_OFF) {
+            return;
+        }
+        int previousPhase = phaseTimer.switchTo(PHASE_WIFI_CONNECT);
+        _udp.stop();
+        WiFi.disconnect(true);
+        WiFi.mode(WIFI_OFF);
+        phaseTimer.switchTo(previousPhase);
+        DEBUG_LOGN("-- LOG: WiFi off");
+    }
 
-    // Get current timestamp from internet
+    // Get current timestamp from internet, waiting for a real NTP answer
+    // (after deep sleep the RTC clock already looks valid to getLocalTime)
     unsigned long getUnixTime() {
-        if (WiFi.status() != WL_CONNECTED) {
-            _connectToWiFi();
+        if (WiFi.status() != WL_CONNECTED && !_connectToWiFi()) {
+            return 0;
         }
 
         // Sync with time server
+        int previousPhase = phaseTimer.switchTo(PHASE_NTP);
+        sntp_set_sync_status(SNTP_SYNC_STATUS_RESET);
         configTime(0, 0, TIME_SERVER);
 
-        struct tm timeinfo;
-        if (!getLocalTime(&timeinfo)) {
-            return 0;
+        unsigned long timeout = millis() + NTP_SYNC_TIMEOUT;
+        while (sntp_get_sync_status() != SNTP_SYNC_STATUS_COMPLETED) {
+            if (millis() > timeout) {
+                DEBUG_LOGN("-- ERROR: NTP sync timed out!");
+                phaseTimer.switchTo(previousPhase);
+                return 0;
+            }
+            delay(10);
         }
+        phaseTimer.switchTo(previousPhase);
         
         time_t now;
         time(&now);
         return now;
     }
 
-    bool uploadData(const String data) {
-        if (WiFi.status() != WL_CONNECTED) {
-            _connectToWiFi();
+    // Stream totalLength bytes from reader in MTU-sized chunks, starting where the server left off.
+    // ackedOffset is kept up to date so a failed upload can resume later.
+    bool uploadData(const char* header, UploadReader reader, uint32_t totalLength, uint32_t streamId, uint32_t& ackedOffset) {
+        if (WiFi.status() != WL_CONNECTED && !_connectToWiFi()) {
+            return false; // No access point, don't spend RETRY_COUNTER timeouts with the radio on
+        }
+
+        // Look the gateway up once per upload rather than on every datagram.
+        // Any gateway will do, they route each device to the same storage shard.
+        if (!_udpServer.fromString(_udpAddress) && !WiFi.hostByName(_udpAddress, _udpServer)) {
+            DEBUG_LOGF("-- ERROR: Can't resolve %s\n", _udpAddress);
+            return false;
+        }
+
+        _streamReset = false;
+        size_t headerLength = strlen(header);
+        if (headerLength > UPLOAD_CHUNK_SIZE - UPLOAD_BEGIN_SIZE) {
+            headerLength = UPLOAD_CHUNK_SIZE - UPLOAD_BEGIN_SIZE;
+        }
+
+        // Tell the server what's coming, it answers with the offset it already has
+        _writeHeader(uploadPacket, UPLOAD_BEGIN, streamId, ackedOffset, UPLOAD_COMPRESSION ? UPLOAD_FLAG_LZSS : 0);
+        uint8_t* payload = uploadPacket + UPLOAD_HEADER_SIZE;
+        for (int i = 0; i < 4; i++) {
+            payload[i] = (totalLength >> (8 * i)) & 0xFF;
+        }
+        payload[4] = UPLOAD_CHUNK_SIZE & 0xFF;
+        payload[5] = UPLOAD_CHUNK_SIZE >> 8;
+        memcpy(payload + UPLOAD_BEGIN_SIZE, header, headerLength);
+        uint32_t offset;
+        if (!_sendDataWithConfirmation(UPLOAD_BEGIN_SIZE + headerLength, offset)) {
+            return false;
+        }
+        if (offset > totalLength) {
+            offset = 0;
+        }
+        _compressChunks = UPLOAD_COMPRESSION && _serverLzss; // Older servers don't answer "lzss"
+        DEBUG_LOGF("-- LOG: Uploading %lu of %lu bytes%s\n", (unsigned long)(totalLength - offset), (unsigned long)totalLength,
+                   _compressChunks ? ", compressed" : "");
+
+        ackedOffset = offset;
+        _sentBytes = 0;
+        if (!_sendWindow(reader, streamId, offset, totalLength, ackedOffset)) {
+            return false;
+        }
+        if (_compressChunks) {
+            DEBUG_LOGF("-- LOG: Sent %lu bytes as %lu\n", (unsigned long)(totalLength - offset), (unsigned long)_sentBytes);
+        }
+
+        _writeHeader(uploadPacket, UPLOAD_END, streamId, totalLength);
+        uint32_t ackOffset;
+        if (!_sendDataWithConfirmation(0, ackOffset) || _streamReset || ackOffset != totalLength) {
+            DEBUG_LOGN("-- ERROR: Server did not confirm the whole upload!");
+            return false;
         }
 
-        return _sendDataWithConfirmation(data.c_str());
+        DEBUG_LOGN("-- SUCCESS: ACK Received!!");
+        return true;
     }
 };
 
-// Save contact data to local storage
-void storeData(const char* fileName, const String data) {
-    DEBUG_LOGF("-- LOG: Writing file: %s\r\n", fileName);
-    File file = SPIFFS.open(fileName, FILE_APPEND);
+// Contact records are collected here and written to flash in one go,
+// instead of an open/append/close per record
+uint8_t logBuffer[LOG_BUFFER_SIZE];
+size_t logBufferLength = 0;
+
+void logSegmentPath(char* path, size_t size, uint32_t segment) {
+    snprintf(path, size, LOG_SEGMENT_FILE, (unsigned long)segment);
+}
+
+// Persist the commit position, stored twice (once inverted) to catch a torn write
+bool saveLogState() {
+    int previousPhase = phaseTimer.switchTo(PHASE_FLASH_WRITE);
+    File file = SPIFFS.open(LOG_STATE_FILE, FILE_WRITE);
     if (!file) {
-        DEBUG_LOGN("-- ERROR: Failed to open file!");
-        return;
+        DEBUG_LOGN("-- ERROR: Failed to open log state file!");
+        phaseTimer.switchTo(previousPhase);
+        return false;
     }
+    uint32_t state[2] = { logCommitPosition, ~logCommitPosition };
+    bool written = file.write((const uint8_t*)state, sizeof(state)) == sizeof(state);
+    file.close();
+    phaseTimer.switchTo(previousPhase);
+    return written;
+}
 
-    // Create CSV header if this is a new file
-    if (file && file.size() == 0) {
-        DEBUG_LOGN("-- LOG: Created the Data File!!");
-        file.println("timeStamp,peerId,rssi,deviceId,uploadDuration,contactDuration,closeContactDuration,exposureStatus");
+// Rebuild the log positions from the segment files after RTC memory was lost
+void loadLogState() {
+    uint32_t firstSegment = UINT32_MAX;
+    uint32_t lastSegment = 0;
+    size_t lastSegmentSize = 0;
+    File root = SPIFFS.open("/");
+    File file = root.openNextFile();
+    while (file) {
+        const char* name = file.name();
+        if (name[0] == '/') name++; // Older cores return the full path
+        unsigned long segment;
+        if (sscanf(name, LOG_SEGMENT_FILE + 1, &segment) == 1) {
+            firstSegment = min(firstSegment, (uint32_t)segment);
+            if (segment >= lastSegment) {
+                lastSegment = segment;
+                lastSegmentSize = file.size();
+            }
+        }
+        file = root.openNextFile();
     }
 
-    if (!file.println(data)) {
-        DEBUG_LOGN("-- ERROR: Write failed!");
+    uint32_t commit = 0;
+    File stateFile = SPIFFS.open(LOG_STATE_FILE, FILE_READ);
+    if (stateFile) {
+        uint32_t state[2];
+        if (stateFile.read((uint8_t*)state, sizeof(state)) == sizeof(state) && state[0] == ~state[1]) {
+            commit = state[0];
+        }
+        stateFile.close();
     }
 
-    file.close();
+    if (firstSegment == UINT32_MAX) {
+        // Nothing left to upload, carry on in a fresh segment
+        logHeadPosition = (commit + LOG_SEGMENT_SIZE - 1) / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+        logCommitPosition = logHeadPosition;
+    } else {
+        logHeadPosition = lastSegment * LOG_SEGMENT_SIZE + lastSegmentSize;
+        logCommitPosition = constrain(commit, firstSegment * LOG_SEGMENT_SIZE, logHeadPosition);
+    }
+    DEBUG_LOGF("-- LOG: Log holds %lu bytes not yet uploaded\n", (unsigned long)(logHeadPosition - logCommitPosition));
+    if (logHeadPosition > logCommitPosition) {
+        oldestPendingTime = time(nullptr); // How long it already waited is lost with the RTC
+    }
+}
+
+// Bytes logged (buffered or on flash) that still have to be uploaded
+uint32_t pendingLogBytes() {
+    return logHeadPosition + logBufferLength - logCommitPosition;
+}
+
+// Space left in the segment the next record goes to
+uint32_t logSegmentSpace() {
+    return LOG_SEGMENT_SIZE - (logHeadPosition + logBufferLength) % LOG_SEGMENT_SIZE;
+}
+
+// Mark everything before position as uploaded and delete the segments that are done
+void commitLog(uint32_t position) {
+    char path[24];
+    for (uint32_t segment = logCommitPosition / LOG_SEGMENT_SIZE; (segment + 1) * LOG_SEGMENT_SIZE <= position; segment++) {
+        logSegmentPath(path, sizeof(path), segment);
+        SPIFFS.remove(path);
+    }
+    logCommitPosition = position;
+    saveLogState();
+}
+
+// Make room for a new segment by dropping the oldest one, uploaded or not
+void dropOldestLogSegment() {
+    uint32_t oldest = logCommitPosition / LOG_SEGMENT_SIZE;
+    DEBUG_LOGF("-- ERROR: Log full, dropping segment %lu!\n", (unsigned long)oldest);
+    commitLog((oldest + 1) * LOG_SEGMENT_SIZE);
+    uploadStreamId = 0; // The stream no longer starts where the server thinks it does
+    uploadAckedOffset = 0;
+}
+
+// Append everything buffered so far to the log, one write per segment touched
+bool flushData() {
+    if (logBufferLength == 0) {
+        return true;
+    }
+
+    DEBUG_LOGF("-- LOG: Writing %u bytes to the log at %lu\r\n", (unsigned)logBufferLength, (unsigned long)logHeadPosition);
+    int previousPhase = phaseTimer.switchTo(PHASE_FLASH_WRITE);
+    bool written = true;
+    size_t flushed = 0;
+    while (flushed < logBufferLength) {
+        uint32_t segment = logHeadPosition / LOG_SEGMENT_SIZE;
+        uint32_t segmentOffset = logHeadPosition % LOG_SEGMENT_SIZE;
+        if (segmentOffset == 0 && segment - logCommitPosition / LOG_SEGMENT_SIZE >= LOG_SEGMENT_COUNT) {
+            dropOldestLogSegment();
+        }
+
+        char path[24];
+        logSegmentPath(path, sizeof(path), segment);
+        File file = SPIFFS.open(path, segmentOffset == 0 ? FILE_WRITE : FILE_APPEND);
+        if (!file) {
+            DEBUG_LOGN("-- ERROR: Failed to open log segment!");
+            written = false;
+            break;
+        }
+
+        size_t length = min(logBufferLength - flushed, (size_t)(LOG_SEGMENT_SIZE - segmentOffset));
+        written = file.write(logBuffer + flushed, length) == length;
+        file.close();
+        if (!written) {
+            DEBUG_LOGN("-- ERROR: Write failed!");
+            break;
+        }
+        logHeadPosition += length;
+        flushed += length;
+    }
+
+    logBufferLength = 0;
+    phaseTimer.switchTo(previousPhase);
+    return written;
+}
+
+// Save contact data to local storage (buffered, see flushData)
+void storeData(const uint8_t* data, size_t length) {
+    if (oldestPendingTime == 0) {
+        oldestPendingTime = time(nullptr);
+    }
+    if (logBufferLength + length > sizeof(logBuffer)) {
+        flushData();
+    }
+    memcpy(logBuffer + logBufferLength, data, length);
+    logBufferLength += length;
+}
+
+// Fill the rest of the current segment so the next record starts a new one
+void padLogSegment() {
+    uint8_t padding[LOG_MAX_RECORD_SIZE];
+    memset(padding, LOG_RECORD_PADDING, sizeof(padding));
+    uint32_t space = logSegmentSpace();
+    while (space < LOG_SEGMENT_SIZE) {
+        size_t length = min(space, (uint32_t)sizeof(padding));
+        storeData(padding, length);
+        space = logSegmentSpace();
+    }
 }
 
-// Read all stored contact data
-String readData(const char* fileName) {
-    if (!SPIFFS.exists(fileName)) {
-        DEBUG_LOGN("-- ERROR: File doesn't exist!");
-        return String();
+// Upload stream reader: LOG_MAGIC, then the log from the commit position on
+File logReadFile;
+uint32_t logReadSegment = UINT32_MAX;
+
+size_t readLogForUpload(uint32_t offset, uint8_t* buffer, size_t length) {
+    size_t read = 0;
+    while (read < length && offset < LOG_MAGIC_LENGTH) {
+        buffer[read++] = LOG_MAGIC[offset++];
+    }
+
+    while (read < length) {
+        uint32_t position = logCommitPosition + offset - LOG_MAGIC_LENGTH;
+        uint32_t segment = position / LOG_SEGMENT_SIZE;
+        if (segment != logReadSegment) {
+            if (logReadFile) logReadFile.close();
+            char path[24];
+            logSegmentPath(path, sizeof(path), segment);
+            logReadFile = SPIFFS.open(path, FILE_READ);
+            logReadSegment = segment;
+        }
+        if (!logReadFile || !logReadFile.seek(position % LOG_SEGMENT_SIZE)) {
+            break;
+        }
+        size_t wanted = min(length - read, (size_t)(LOG_SEGMENT_SIZE - position % LOG_SEGMENT_SIZE));
+        size_t count = logReadFile.read(buffer + read, wanted);
+        if (count == 0) {
+            break;
+        }
+        read += count;
+        offset += count;
     }
+    return read;
+}
+
+void closeLogReader() {
+    if (logReadFile) logReadFile.close();
+    logReadSegment = UINT32_MAX;
+}
 
-    File file = SPIFFS.open(fileName, "r");
+// Overflow store for tracked devices: the record for index position p sits at
+// p * sizeof(TrackedContact) in OVERFLOW_FILE. The tracker's index in RTC memory says
+// which positions are in use, so nothing on flash is ever marked free. Spills wait in
+// RAM and go to flash in one pass at the end of the scan (on the storage task with
+// STORAGE_TASK); restores find the newest ones there first.
+struct PendingSpill {
+    int position;
+    TrackedContact contact;
+};
+PendingSpill pendingSpills[OVERFLOW_SPILL_BATCH];
+int pendingSpillCount = 0;
+
+// Write the pending spills, one file open for all of them
+void flushOverflowSpills() {
+    if (pendingSpillCount == 0) return;
+    File file = SPIFFS.open(OVERFLOW_FILE, SPIFFS.exists(OVERFLOW_FILE) ? "r+" : "w+");
     if (!file) {
-        DEBUG_LOGN("-- ERROR: Failed to open file!");
-        return String();
+        DEBUG_LOGN("-- ERROR: Failed to open overflow file!");
+        overflowDropCount += pendingSpillCount; // Their index entries won't match anything on restore
+        pendingSpillCount = 0;
+        return;
+    }
+
+    TrackedContact unused;
+    memset(&unused, 0, sizeof(unused));
+    for (int i = 0; i < pendingSpillCount; i++) {
+        size_t offset = pendingSpills[i].position * sizeof(TrackedContact);
+        while (file.size() < offset) { // SPIFFS can't seek past the end, fill up to it
+            file.seek(file.size());
+            if (file.write((const uint8_t*)&unused, sizeof(unused)) != sizeof(unused)) break;
+        }
+        if (!file.seek(offset) ||
+            file.write((const uint8_t*)&pendingSpills[i].contact, sizeof(TrackedContact)) != sizeof(TrackedContact)) {
+            DEBUG_LOGN("-- ERROR: Overflow write failed!");
+            overflowDropCount++;
+        }
+    }
+    file.close();
+    pendingSpillCount = 0;
+}
+
+// Move an evicted device out to flash, or at least into the next batch for it
+bool spillTrackedDevice(int position, const TrackedContact& contact) {
+    if (pendingSpillCount == OVERFLOW_SPILL_BATCH) {
+        flushOverflowSpills();
     }
+    pendingSpills[pendingSpillCount].position = position;
+    pendingSpills[pendingSpillCount].contact = contact;
+    pendingSpillCount++;
+    return true;
+}
 
-    String content = "";
-    while (file.available()) {
-        content += (char)file.read();
+// Bring a previously evicted device back, from the pending batch or its record on flash
+bool restoreTrackedDevice(int position, const uint8_t* deviceAddress, TrackedContact& contact) {
+    for (int i = pendingSpillCount - 1; i >= 0; i--) {
+        if (pendingSpills[i].position != position) continue;
+        if (memcmp(pendingSpills[i].contact.address, deviceAddress, MAC_ADDRESS_LENGTH) != 0) {
+            return false; // The position went to another device since
+        }
+        contact = pendingSpills[i].contact;
+        pendingSpillCount--;
+        memmove(&pendingSpills[i], &pendingSpills[i + 1], (pendingSpillCount - i) * sizeof(PendingSpill));
+        return true;
     }
-    DEBUG_LOGN("-- LOG: Data:");
-    DEBUG_LOGN(content);
 
+    File file = SPIFFS.open(OVERFLOW_FILE, "r");
+    if (!file) {
+        return false;
+    }
+    bool read = file.seek(position * sizeof(TrackedContact)) &&
+                file.read((uint8_t*)&contact, sizeof(contact)) == sizeof(contact);
     file.close();
-    return content;
+    return read && contact.used && memcmp(contact.address, deviceAddress, MAC_ADDRESS_LENGTH) == 0;
 }
 
 // Check if file system is working properly
@@ -242,133 +966,361 @@ void checkSPIFFS() {
     DEBUG_LOGN("--- End Diagnostics ---\n");
 }
 
+// Set by the scan completion callback, which can't carry any context
+volatile bool bleScanRunning = false;
+
+void onScanComplete(BLEScanResults results) {
+    bleScanRunning = false;
+}
+
+// One advertisement from another tracer, as much as we need of it
+struct Sighting {
+    uint8_t address[MAC_ADDRESS_LENGTH]; // Peer ID, the start of its rolling ID
+    int8_t rssi;
+    uint32_t seenAt; // millis()
+};
+
+// Fixed-size queue from the BLE callback (producer) to the main loop (consumer).
+// Lock-free because each index is only ever written by one side.
+class SightingRing {
+private:
+    Sighting _items[SIGHTING_RING_SIZE];
+    std::atomic<uint32_t> _head{0}; // Next write, producer only
+    std::atomic<uint32_t> _tail{0}; // Next read, consumer only
+
+public:
+    uint32_t dropped = 0;
+
+    bool push(const Sighting& sighting) {
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        if (head - _tail.load(std::memory_order_acquire) >= SIGHTING_RING_SIZE) {
+            dropped++;
+            return false;
+        }
+        _items[head & (SIGHTING_RING_SIZE - 1)] = sighting;
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(Sighting& sighting) {
+        uint32_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        sighting = _items[tail & (SIGHTING_RING_SIZE - 1)];
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// Format a binary peer ID or MAC the way BLEAddress::toString() does
+void formatDeviceAddress(const uint8_t* deviceAddress, char* out) {
+    snprintf(out, 18, "%02x:%02x:%02x:%02x:%02x:%02x", deviceAddress[0], deviceAddress[1],
+             deviceAddress[2], deviceAddress[3], deviceAddress[4], deviceAddress[5]);
+}
+
+#if TRACER_ADV_DATA_LENGTH != 3 + ROLLING_ID_LENGTH + 1
+#error "TRACER_ADV_DATA_LENGTH must cover the company ID, version, rolling ID and TX power"
+#endif
+#if ROLLING_ID_LENGTH < MAC_ADDRESS_LENGTH || ROLLING_ID_LENGTH + MAC_ADDRESS_LENGTH > 32
+#error "ROLLING_ID_LENGTH must hold a peer ID and leave room for the address in the HMAC"
+#endif
+
 // Scans for other contact tracing devices nearby
 class BluetoothScanner {
 private:
+    // Filters advertisements as they arrive, anything that isn't a tracer is dropped on the spot
+    class SightingCallbacks : public BLEAdvertisedDeviceCallbacks {
+    public:
+        BluetoothScanner* owner;
+        SightingRing ring;
+
+        void onResult(BLEAdvertisedDevice advertisedDevice) override {
+            Sighting sighting;
+            int8_t txPower;
+            if (advertisedDevice.getRSSI() < MIN_RSSI ||
+                !owner->isContactTracingDevice(advertisedDevice, txPower, sighting.address)) {
+                return;
+            }
+            // A peer that is quieter at 1 m than we are gets counted as if it were as loud,
+            // so the one path loss model fits every peer
+            sighting.rssi = constrain(advertisedDevice.getRSSI() + TRACER_TX_POWER - txPower, -128, 127);
+            sighting.seenAt = millis();
+            if (ring.push(sighting) && owner->storageTask) {
+                xTaskNotifyGive(owner->storageTask);
+            }
+        }
+    };
+    SightingCallbacks sightings;
+
+    // Scan progress, kept by whichever task takes the sightings off the ring
+    std::atomic<int> tracerPeersSeen{0};
+    std::atomic<uint32_t> lastNewPeerTime{0};
+
+    // Storage task (STORAGE_TASK): takes sightings off the ring during the scan, then records
+    // the scan's contacts and writes them to flash while the main task shuts BLE down
+    TaskHandle_t storageTask = nullptr;
+    TaskHandle_t mainTask = nullptr;
+    std::atomic<bool> scanEnded{false};
+
     const unsigned long startTime;
-    String deviceId;
+    uint8_t rollingId[ROLLING_ID_LENGTH]; // What we advertise during this boot
+    uint8_t advertisingAddress[MAC_ADDRESS_LENGTH]; // And the random address we advertise it from
+    uint32_t deviceNumber; // Start of rollingId, as stored in the log
     unsigned long lastUploadDuration;
-
-    // Create a unique ID for this device
-    String generateDeviceId() {
-        String id = "ESP32_";
-        for (int i = 0; i < DEVICE_ID_LENGTH; i++) {
-            id += String(random(0, 10));
+    bool sessionLogged;
+    unsigned long lastLoggedTime;
+
+    static BluetoothScanner* active; // The scan whose sightings are being tracked
+
+    // Work out the rolling ID and address for the interval this boot falls in. They only
+    // change when the interval does, so advertising is set up once per boot and never
+    // restarted for it.
+    void updateRollingId() {
+        uint32_t day = startTime / 86400;
+        if (!dailyKeyValid || dailyKeyDay != day) {
+            esp_fill_random(dailyKey, sizeof(dailyKey));
+            dailyKeyDay = day;
+            dailyKeyValid = true;
+            DEBUG_LOGN("-- LOG: New daily key");
         }
-        return id;
-    }
 
-    // Change our broadcast ID periodically for privacy
-    void updateDeviceId() {
-        deviceId = generateDeviceId();
-        DEBUG_LOG("Updated Device ID: ");
-        DEBUG_LOGN(deviceId);
-        
-        BLEAdvertising *advertising = BLEDevice::getAdvertising();
-        advertising->stop();
-        
-        BLEAdvertisementData adData;
-        adData.setManufacturerData(deviceId);
-        advertising->setAdvertisementData(adData);
-        
-        advertising->start();
+        uint32_t interval = startTime / ROLLING_ID_INTERVAL;
+        uint8_t message[8] = {'C', 'T', 'R', 'I'};
+        putUint32(message + 4, interval);
+        uint8_t digest[32];
+        mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), dailyKey, sizeof(dailyKey), message, sizeof(message), digest);
+        memcpy(rollingId, digest, ROLLING_ID_LENGTH);
+        deviceNumber = rollingId[0] | rollingId[1] << 8 | rollingId[2] << 16 | (uint32_t)rollingId[3] << 24;
+
+        // A fixed address next to the ID would link every ID we ever had, so the address
+        // comes from the same HMAC: non-resolvable private for a beacon, static random
+        // when connectable (non-resolvable ones can't take connections)
+        memcpy(advertisingAddress, digest + ROLLING_ID_LENGTH, MAC_ADDRESS_LENGTH);
+#if BLE_BEACON_ONLY
+        advertisingAddress[0] &= 0x3F;
+#else
+        advertisingAddress[0] |= 0xC0;
+#endif
     }
 
-    // Check if this is another contact tracing device
-    bool isContactTracingDevice(BLEAdvertisedDevice device) {
-        String manufacturerData = device.getManufacturerData();
-
-        if (manufacturerData.length() > 0) {
-            if (manufacturerData.indexOf("ESP32_") != -1 && manufacturerData != deviceId) {
-                return true;
+    // Check if this is another contact tracing device, straight from the raw
+    // advertisement so no String is built for every phone and headset nearby.
+    // txPower gets the RSSI it says it has at 1 m, peerId the start of its rolling ID.
+    bool isContactTracingDevice(BLEAdvertisedDevice& device, int8_t& txPower, uint8_t* peerId) {
+        // A tracer's manufacturer data up to the rolling ID: company ID, version
+        static const uint8_t tracerPrefix[] = {TRACER_COMPANY_ID & 0xFF, TRACER_COMPANY_ID >> 8, TRACER_ADV_VERSION};
+        const uint8_t* payload = device.getPayload();
+        size_t payloadLength = device.getPayloadLength();
+
+        // Walk the AD structures: length byte, type byte, data. Only a whole field of
+        // exactly the tracer's length and type is compared, so nothing is read past it.
+        size_t i = 0;
+        while (i + 1 < payloadLength) {
+            uint8_t fieldLength = payload[i];
+            if (fieldLength == 0 || i + 1 + fieldLength > payloadLength) {
+                break;
+            }
+            if (fieldLength == 1 + TRACER_ADV_DATA_LENGTH && payload[i + 1] == 0xFF &&
+                memcmp(payload + i + 2, tracerPrefix, sizeof(tracerPrefix)) == 0) {
+                const uint8_t* advertisedId = payload + i + 2 + sizeof(tracerPrefix);
+                txPower = (int8_t)advertisedId[ROLLING_ID_LENGTH];
+                memcpy(peerId, advertisedId, MAC_ADDRESS_LENGTH);
+                return memcmp(advertisedId, rollingId, ROLLING_ID_LENGTH) != 0; // Not our own
             }
+            i += 1 + fieldLength;
         }
 
         return false;
     }
 
-    // Record when we see another device and track exposure risk
-    void recordDeviceContact(BLEAdvertisedDevice device) {
-        String deviceAddress = device.getAddress().toString();
-        int rssi = device.getRSSI();
-        
-        unsigned long currentTime = startTime + (millis() / 1000);
-        
-        // Track first contact time
-        unsigned long firstSeen = getFirstSeenTime(deviceAddress.c_str());
-        if (firstSeen == 0) {
-            addOrUpdateTrackedDevice(deviceAddress.c_str(), currentTime);
-            firstSeen = currentTime;
+    // Count a sighting towards its peer, returns true the first time a peer shows up in this scan
+    bool trackSighting(const Sighting& sighting) {
+        unsigned long currentTime = startTime + (sighting.seenAt / 1000);
+
+        bool newThisBoot;
+        int slot = recordSighting(sighting.address, sighting.rssi, currentTime, newThisBoot);
+        if (!newThisBoot) {
+            return false;
+        }
+
+        char deviceAddress[18];
+        formatDeviceAddress(sighting.address, deviceAddress);
+        DEBUG_LOG("Found contact tracing device: ");
+        DEBUG_LOGN(deviceAddress);
+        DEBUG_LOG("RSSI: ");
+        DEBUG_LOGN(sighting.rssi);
+        if (getFirstSeenTime(slot) == currentTime) {
             DEBUG_LOG("First contact with device: ");
             DEBUG_LOG(deviceAddress);
             DEBUG_LOG(" at time: ");
             DEBUG_LOGN(currentTime);
         }
-        
-        // Update close contact tracking
-        updateCloseContact(deviceAddress.c_str(), currentTime, rssi);
-        
-        unsigned long contactDuration = currentTime - firstSeen;
-        unsigned long closeContactDuration = getCloseContactDuration(deviceAddress.c_str());
-        
-        // Add ongoing close contact time if still in range
-        int index = findTrackedDevice(deviceAddress.c_str());
-        if (index >= 0 && lastCloseContactTimes[index] > 0) {
-            closeContactDuration += (currentTime - lastCloseContactTimes[index]);
-        }
-        
-        // Check if this counts as an exposure event
-        bool isExposure = isExposureEvent(deviceAddress.c_str(), currentTime);
-        String exposureStatus = isExposure ? "EXPOSURE" : "NORMAL";
+        return true;
+    }
+
+    // Update close contact and exposure from the peer's filtered RSSI and log what changed
+    void recordDeviceContact(int slot, unsigned long currentTime) {
+        const uint8_t* macAddress = trackedDevices[slot].address;
+        bool wasExposed = trackedDevices[slot].exposureLogged;
+
+        ContactUpdate update;
+        bool shouldLog = evaluateContact(slot, currentTime, update);
+
+        char deviceAddress[18];
+        formatDeviceAddress(macAddress, deviceAddress);
+        const char* exposureStatus = update.isExposure ? "EXPOSURE" : "NORMAL";
         
         DEBUG_LOG("Device: ");
         DEBUG_LOG(deviceAddress);
         DEBUG_LOG(" RSSI: ");
-        DEBUG_LOG(rssi);
+        DEBUG_LOG(update.rssi);
+        DEBUG_LOGF(" (~%.1fm)", estimateDistance(trackedDevices[slot].filteredRssi));
         DEBUG_LOG(" Total: ");
-        DEBUG_LOG(contactDuration);
+        DEBUG_LOG(update.contactDuration);
         DEBUG_LOG("s Close: ");
-        DEBUG_LOG(closeContactDuration);
+        DEBUG_LOG(update.closeContactDuration);
+        DEBUG_LOG("s Window: ");
+        DEBUG_LOG(update.windowCloseTime);
         DEBUG_LOG("s Status: ");
         DEBUG_LOGN(exposureStatus);
         
         // Alert if potential exposure detected
-        if (isExposure) {
+        if (update.isExposure) {
             DEBUG_LOG("*** EXPOSURE EVENT DETECTED with ");
             DEBUG_LOG(deviceAddress);
             DEBUG_LOG(" (");
-            DEBUG_LOG(closeContactDuration);
+            DEBUG_LOG(update.closeContactDuration);
             DEBUG_LOGN(" seconds close contact) ***");
         }
+
+        if (!shouldLog) {
+            return; // Nothing changed since its last record
+        }
+        if (update.isExposure && !wasExposed) {
+            exposurePending = true;
+        }
         
-        // Save this contact event
-        String data = String(currentTime) + "," + deviceAddress + "," + String(rssi) + "," + deviceId + "," + String(lastUploadDuration) + "," + String(contactDuration) + "," + String(closeContactDuration) + "," + exposureStatus;
-        storeData(DATA_FILE, data);
+        // Save this contact event, starting the boot's session first. Each log
+        // segment opens with its own session record so it decodes on its own.
+        uint8_t record[2 * LOG_MAX_RECORD_SIZE];
+        size_t recordLength = 0;
+        if (logSegmentSpace() < sizeof(record)) {
+            padLogSegment();
+        }
+        if (!sessionLogged || logSegmentSpace() == LOG_SEGMENT_SIZE) {
+            unsigned long anchorTime = sessionLogged ? lastLoggedTime : startTime;
+            recordLength += encodeSessionRecord(record, anchorTime, deviceNumber, lastUploadDuration);
+            lastLoggedTime = anchorTime;
+            sessionLogged = true;
+        }
+        recordLength += encodeContactRecord(record + recordLength, macAddress, update.rssi, currentTime - lastLoggedTime,
+                                            update.contactDuration, update.closeContactDuration, update.isExposure,
+                                            update.event);
+        lastLoggedTime = currentTime;
+        storeData(record, recordLength);
+    }
+
+    // Work through the sightings buffered so far
+    void drainSightings() {
+        Sighting sighting;
+        while (sightings.ring.pop(sighting)) {
+            if (trackSighting(sighting)) {
+                tracerPeersSeen++;
+                lastNewPeerTime = millis();
+            }
+        }
+    }
+
+    // Once the scan is over: the last sightings, a record per peer and one flash write
+    void finishScan() {
+        drainSightings();
+        recordScanContacts();
+        active = nullptr;
+        flushOverflowSpills();
+
+        DEBUG_LOG("Tracer Devices Found: ");
+        DEBUG_LOGN(tracerPeersSeen.load());
+        if (overflowDropCount > 0) {
+            DEBUG_LOGF("-- LOG: %lu tracked peers dropped from a full overflow store since the last upload\n",
+                       (unsigned long)overflowDropCount);
+        }
+        if (sightings.ring.dropped > 0) {
+            DEBUG_LOGF("-- LOG: Sighting buffer overflowed, %lu advertisements dropped\n", (unsigned long)sightings.ring.dropped);
+        }
+        DEBUG_LOGN("Scan Complete!");
+        flushData(); // One write for the whole scan
     }
 
-    // Process each device we found in the scan
-    void processScannedDevice(BLEAdvertisedDevice device) {
-        if (isContactTracingDevice(device) && device.getRSSI() >= MIN_RSSI) {
-            DEBUG_LOG("Found contact tracing device: ");
-            DEBUG_LOGN(device.getAddress().toString());
-            DEBUG_LOG("RSSI: ");
-            DEBUG_LOGN(device.getRSSI());
-            recordDeviceContact(device);
+    static void storageTaskMain(void* parameter) {
+        BluetoothScanner* scanner = (BluetoothScanner*)parameter;
+        while (true) {
+            bool ended = scanner->scanEnded; // Read first, so nothing pushed before the end is missed
+            scanner->drainSightings();
+            if (ended) break;
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+        }
+        scanner->finishScan();
+        xTaskNotifyGive(scanner->mainTask);
+        vTaskDelete(nullptr);
+    }
+
+    // Log every peer seen in this scan, now that their filters have all the samples
+    void recordScanContacts() {
+        unsigned long currentTime = startTime + millis() / 1000;
+        for (int slot = 0; slot < TRACKED_TABLE_SIZE; slot++) {
+            if (trackedDevices[slot].used && wasSeenThisBoot(slot)) {
+                recordDeviceContact(slot, currentTime);
+            }
         }
     }
 
 public:
     BluetoothScanner(unsigned long unixTime, unsigned long uploadDuration = 0)
-        : startTime(unixTime), lastUploadDuration(uploadDuration) {
-        randomSeed(micros());
-        deviceId = generateDeviceId();
-        DEBUG_LOG("Generated Device ID: ");
-        DEBUG_LOGN(deviceId);
+        : startTime(unixTime), lastUploadDuration(uploadDuration), sessionLogged(false), lastLoggedTime(unixTime) {
+        updateRollingId();
+        char addressText[18];
+        formatDeviceAddress(advertisingAddress, addressText);
+        DEBUG_LOGF("-- LOG: Rolling ID for interval %lu, logged as device %lu, advertised from %s\n",
+                   (unsigned long)(startTime / ROLLING_ID_INTERVAL), (unsigned long)deviceNumber, addressText);
     }
 
-    // Set up Bluetooth advertising and services
+    // A peer evicted from the RTC table mid-scan gets its record before it goes to flash
+    static void recordEvicted(int slot, unsigned long currentTime) {
+        if (active) {
+            active->recordDeviceContact(slot, currentTime);
+        }
+    }
+
+    // Set up Bluetooth advertising (and with BLE_BEACON_ONLY off, the GATT service)
     void initBluetooth() {
+        unsigned long initStart = micros();
         BLEDevice::init(BLE_DEVICE_NAME);
+
+        uint8_t manufacturerData[TRACER_ADV_DATA_LENGTH];
+        manufacturerData[0] = TRACER_COMPANY_ID & 0xFF;
+        manufacturerData[1] = TRACER_COMPANY_ID >> 8;
+        manufacturerData[2] = TRACER_ADV_VERSION;
+        memcpy(manufacturerData + 3, rollingId, ROLLING_ID_LENGTH);
+        manufacturerData[3 + ROLLING_ID_LENGTH] = (uint8_t)TRACER_TX_POWER;
+
+#if BLE_BEACON_ONLY
+        // Nothing connects to us, so the advertisement is the whole job: flags and the
+        // manufacturer data in one raw packet, non-connectable, no scan response
+        uint8_t advertisement[3 + 2 + TRACER_ADV_DATA_LENGTH] = {2, 0x01, 0x06, 1 + TRACER_ADV_DATA_LENGTH, 0xFF};
+        memcpy(advertisement + 5, manufacturerData, sizeof(manufacturerData));
+        esp_ble_gap_config_adv_data_raw(advertisement, sizeof(advertisement));
+        esp_ble_gap_set_rand_addr(advertisingAddress);
+
+        esp_ble_adv_params_t params = {};
+        params.adv_int_min = BLE_ADV_INTERVAL_MIN;
+        params.adv_int_max = BLE_ADV_INTERVAL_MAX;
+        params.adv_type = ADV_TYPE_NONCONN_IND;
+        params.own_addr_type = BLE_ADDR_TYPE_RANDOM; // advertisingAddress, never the fixed public one
+        params.channel_map = ADV_CHNL_ALL;
+        params.adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY;
+        esp_ble_gap_start_advertising(&params);
+#else
         BLEServer *bleServer = BLEDevice::createServer();
 
         DEBUG_LOGN("LOG: Started Bluetooth Server!!");
@@ -381,151 +1333,220 @@ public:
         BLEAdvertising *advertising = BLEDevice::getAdvertising();
 
         BLEAdvertisementData adData;
-        adData.setManufacturerData(deviceId);
+        adData.setFlags(0x06); // LE general discoverable, no BR/EDR
+        adData.setManufacturerData(String((const char*)manufacturerData, sizeof(manufacturerData)));
         advertising->setAdvertisementData(adData);
         advertising->addServiceUUID(SERVICE_UUID);
         advertising->setScanResponse(true);
         advertising->setMinPreferred(0x06);
         advertising->setMinPreferred(0x12);
+        advertising->setDeviceAddress(advertisingAddress, BLE_ADDR_TYPE_RANDOM);
         advertising->start();
+#endif
+        DEBUG_LOGF("-- LOG: BLE up in %lu us\n", (unsigned long)(micros() - initStart));
     }
 
-    // Do a Bluetooth scan and process any devices we find
+    // Do a Bluetooth scan and process any devices we find. With the storage task running,
+    // the contacts may still be getting written when this returns, see waitForStorage().
     void performScan() {
         BLEScan *scanner = BLEDevice::getScan();
-        scanner->setActiveScan(true);
-        scanner->setWindow(99);
-
-        BLEScanResults *results = scanner->start(SCAN_DURATION, false);
-        int deviceCount = results->getCount();
-
-        DEBUG_LOG("Devices Found: ");
-        DEBUG_LOGN(deviceCount);
-        DEBUG_LOGN("Scan Complete!");
+        scanner->setActiveScan(BLE_ACTIVE_SCAN);
+        scanner->setInterval(BLE_SCAN_INTERVAL);
+        scanner->setWindow(BLE_SCAN_WINDOW);
+
+        // Duplicates on: the library then hands every advertisement to the callback and
+        // keeps none of them itself, so heap use doesn't grow with the crowd.
+        // Parsing off: we read the raw payload, so skip building Strings for every field.
+        sightings.owner = this;
+        scanner->setAdvertisedDeviceCallbacks(&sightings, true, false);
+
+        // Scan in the background, work through sightings as they arrive and stop
+        // as soon as there's nothing more to learn
+        lastNewPeerTime = millis();
+        active = this;
+#if STORAGE_TASK
+        mainTask = xTaskGetCurrentTaskHandle();
+        if (xTaskCreate(storageTaskMain, "storage", STORAGE_TASK_STACK, this, STORAGE_TASK_PRIORITY, &storageTask) != pdPASS) {
+            DEBUG_LOGN("-- ERROR: No storage task, processing inline");
+            storageTask = nullptr;
+        }
+#endif
+        bleScanRunning = true;
+        scanner->start(SCAN_DURATION, onScanComplete, false);
+        while (bleScanRunning) {
+            if (!storageTask) {
+                phaseTimer.switchTo(PHASE_PROCESSING);
+                drainSightings();
+                phaseTimer.switchTo(PHASE_SCAN);
+            }
+            if (SCAN_EARLY_EXIT_PEERS > 0 && tracerPeersSeen >= SCAN_EARLY_EXIT_PEERS) {
+                DEBUG_LOGN("-- LOG: Enough peers seen, ending scan early");
+                break;
+            }
+            if (SCAN_IDLE_TIMEOUT > 0 && millis() - lastNewPeerTime > SCAN_IDLE_TIMEOUT) {
+                DEBUG_LOGN("-- LOG: No new peers for a while, ending scan early");
+                break;
+            }
+            delay(10);
+        }
+        if (bleScanRunning) {
+            scanner->stop();
+            bleScanRunning = false;
+        }
 
-        // Check each device we found
-        for (int i = 0; i < deviceCount; i++) {
-            BLEAdvertisedDevice device = results->getDevice(i);
-            processScannedDevice(device);
+        if (storageTask) {
+            scanEnded = true;
+            xTaskNotifyGive(storageTask);
+            return;
         }
+        int previousPhase = phaseTimer.switchTo(PHASE_PROCESSING);
+        finishScan();
+        phaseTimer.switchTo(previousPhase);
+    }
 
-        scanner->clearResults();
-        updateDeviceId(); // Change our ID for next scan
+    // Wait for the storage task to have everything on flash, returns how many tracer peers the scan saw
+    int waitForStorage() {
+        if (storageTask) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            storageTask = nullptr;
+        }
+        return tracerPeersSeen;
     }
 };
+BluetoothScanner* BluetoothScanner::active = nullptr;
 
-// Helper functions for tracking devices between sleep cycles
+// The tracker's hook for peers it evicts (see contact_tracker.h)
+void recordEvictedContact(int slot, unsigned long currentTime) {
+  BluetoothScanner::recordEvicted(slot, currentTime);
+}
 
-// Find a device in our tracking list
-int findTrackedDevice(const char* deviceAddress) {
-  for (int i = 0; i < trackedDeviceCount; i++) {
-    if (strcmp(trackedDevices[i], deviceAddress) == 0) {
-      return i;
-    }
+// Main program starts here
+void setup() {
+  Serial.begin(115200);
+
+  initializeStorage(); // Set up file system
+  
+  logBootInfo(); // Show boot stats
+
+  // The radios share the RF path, so they take turns and each one is shut down as
+  // soon as its phase is over. Wi-Fi only goes first if the clock was never set.
+  WifiDataSender wifiSender = WifiDataSender(SSID, PASSWORD, UDP_ADDRESS, UDP_PORT, true);
+  if (lastTimeSync == 0) {
+    getCurrentTime(wifiSender); // Contact times are meaningless without it
+    wifiSender.shutdown();
   }
-  return -1;
-}
+  unsigned long currentTime = (lastTimeSync > 0) ? time(nullptr) : 0;
+  
+  int peersSeen = performBluetoothScan(currentTime); // Scan for nearby devices, Wi-Fi off
+  
+  // Wi-Fi phase, only if the clock or the upload policy asks for it
+  currentTime = getCurrentTime(wifiSender);
+  uploadDataIfNeeded(wifiSender, currentTime); // Send data to server if it's time
+  wifiSender.shutdown();
 
-// When did we first see this device?
-unsigned long getFirstSeenTime(const char* deviceAddress) {
-  int index = findTrackedDevice(deviceAddress);
-  return (index >= 0) ? firstSeenTimes[index] : 0;
+  enterDeepSleep(scheduleNextWake(peersSeen, currentTime)); // Sleep to save battery
 }
 
-// Add a new device to our tracking list
-void addOrUpdateTrackedDevice(const char* deviceAddress, unsigned long currentTime) {
-  if (findTrackedDevice(deviceAddress) >= 0) {
-    return; // Already tracking this one
+// Why this boot should upload, or NULL if it shouldn't
+const char* getUploadTrigger() {
+  uint32_t pending = pendingLogBytes();
+  if (pending == 0) {
+    return NULL;
   }
-  
-  if (trackedDeviceCount < MAX_TRACKED_DEVICES) {
-    int newIndex = trackedDeviceCount++;
-    strcpy(trackedDevices[newIndex], deviceAddress);
-    firstSeenTimes[newIndex] = currentTime;
-    closeContactDurations[newIndex] = 0;
-    lastCloseContactTimes[newIndex] = 0;
-    
-    DEBUG_LOG("Started tracking device: ");
-    DEBUG_LOGN(deviceAddress);
+
+  time_t now = time(nullptr);
+  bool backingOff = uploadFailures > 0 && now < nextUploadAttempt &&
+                    nextUploadAttempt - now <= UPLOAD_RETRY_MAX_BACKOFF; // Ignore it if the clock jumped back
+  if (backingOff) {
+    return NULL;
   }
+
+  if (UPLOAD_ON_EXPOSURE && exposurePending) {
+    return "exposure";
+  }
+  if (pending >= UPLOAD_PENDING_BYTES) {
+    return "pending data";
+  }
+  if (oldestPendingTime > 0 && now - oldestPendingTime >= UPLOAD_MAX_STALENESS) {
+    return "stale data";
+  }
+  return NULL;
 }
 
-// How long have we been in close contact with this device?
-unsigned long getCloseContactDuration(const char* deviceAddress) {
-  int index = findTrackedDevice(deviceAddress);
-  return (index >= 0) ? closeContactDurations[index] : 0;
+bool isUploadDue() {
+  return getUploadTrigger() != NULL;
 }
 
-// Update close contact tracking based on signal strength
-void updateCloseContact(const char* deviceAddress, unsigned long currentTime, int rssi) {
-  int index = findTrackedDevice(deviceAddress);
-  if (index < 0) return;
-  
-  // Strong signal = close contact (within ~1.5m)
-  bool isCloseContact = (rssi >= CLOSE_CONTACT_RSSI);
-  bool wasInCloseContact = (lastCloseContactTimes[index] > 0);
-  
-  if (isCloseContact && !wasInCloseContact) {
-    // Just got close - start timing
-    lastCloseContactTimes[index] = currentTime;
-  } else if (!isCloseContact && wasInCloseContact) {
-    // Moved away - add to total close contact time
-    unsigned long contactDuration = currentTime - lastCloseContactTimes[index];
-    closeContactDurations[index] += contactDuration;
-    lastCloseContactTimes[index] = 0;
-    
-    DEBUG_LOG("Close contact ended. Added ");
-    DEBUG_LOG(contactDuration);
-    DEBUG_LOG(" seconds to device ");
-    DEBUG_LOGN(deviceAddress);
+// Failed uploads wait UPLOAD_RETRY_MIN_BACKOFF, doubling per failure
+void backOffUpload() {
+  if (uploadFailures < 255) {
+    uploadFailures++;
+  }
+  uint32_t backoff = UPLOAD_RETRY_MIN_BACKOFF;
+  for (int i = 1; i < uploadFailures && backoff < UPLOAD_RETRY_MAX_BACKOFF; i++) {
+    backoff *= 2;
   }
+  backoff = min(backoff, (uint32_t)UPLOAD_RETRY_MAX_BACKOFF);
+  nextUploadAttempt = time(nullptr) + backoff;
+  DEBUG_LOGF("-- LOG: Upload failed %d times in a row, next attempt in %lu s\n", uploadFailures, (unsigned long)backoff);
 }
 
-// Check if this counts as a potential exposure event
-bool isExposureEvent(const char* deviceAddress, unsigned long currentTime) {
-  int index = findTrackedDevice(deviceAddress);
-  if (index < 0) return false;
-  
-  unsigned long totalCloseContactTime = closeContactDurations[index];
-  
-  // Include current close contact session if ongoing
-  if (lastCloseContactTimes[index] > 0) {
-    totalCloseContactTime += (currentTime - lastCloseContactTimes[index]);
+// Do we need NTP this boot, or can we trust the RTC clock?
+bool isTimeSyncDue(time_t now) {
+  if (lastTimeSync == 0 || now < lastTimeSync) {
+    return true; // Never synced, or the RTC was reset
   }
-  
-  // Exposure = 5+ minutes of close contact
-  return totalCloseContactTime >= EXPOSURE_TIME_THRESHOLD;
+
+  unsigned long sinceSync = now - lastTimeSync;
+  unsigned long expectedDrift = (unsigned long)((uint64_t)sinceSync * abs(clockDriftPpm) / 1000000);
+  if (expectedDrift > MAX_CLOCK_DRIFT_SECONDS) {
+    return true;
+  }
+
+  // WiFi is coming up anyway on upload cycles, so top up the clock then
+  return isUploadDue() && sinceSync >= CLOCK_RESYNC_INTERVAL;
 }
 
-// Main program starts here
-void setup() {
-  Serial.begin(115200);
-  delay(100);
+// Current Unix time from the RTC clock, resyncing over NTP only when it's due
+// (at most once per boot, a failed sync isn't retried until the next one)
+bool clockSyncAttempted = false;
 
-  initializeStorage(); // Set up file system
-  
-  WifiDataSender wifiSender = WifiDataSender(SSID, PASSWORD, UDP_ADDRESS, UDP_PORT, true);
-  unsigned long currentTime = wifiSender.getUnixTime(); // Get current timestamp
-  
-  logBootInfo(); // Show boot stats
-  
-  performBluetoothScan(currentTime); // Scan for nearby devices
-  
-  uploadDataIfNeeded(wifiSender, currentTime); // Send data to server if it's time
+unsigned long getCurrentTime(WifiDataSender& wifiSender) {
+  time_t localTime = time(nullptr);
+  if (clockSyncAttempted || !isTimeSyncDue(localTime)) {
+    return (lastTimeSync > 0) ? localTime : 0;
+  }
+
+  DEBUG_LOGN("-- LOG: Clock resync due");
+  clockSyncAttempted = true;
+  unsigned long ntpTime = wifiSender.getUnixTime();
+  if (ntpTime == 0) {
+    return (lastTimeSync > 0) ? localTime : 0; // Keep going on the RTC clock
+  }
 
-  enterDeepSleep(); // Sleep to save battery
+  // How far did the RTC wander since the last sync?
+  if (lastTimeSync > 0 && localTime > lastTimeSync && localTime - lastTimeSync >= MIN_DRIFT_MEASURE_SECONDS) {
+    long error = (long)ntpTime - (long)localTime;
+    clockDriftPpm = (int32_t)((int64_t)error * 1000000 / (localTime - lastTimeSync));
+    DEBUG_LOGF("-- LOG: Clock was off by %ld s, drift %ld ppm\n", error, (long)clockDriftPpm);
+  }
+  lastTimeSync = ntpTime;
+  return ntpTime;
 }
 
 void initializeStorage() {
+  int previousPhase = phaseTimer.switchTo(PHASE_STORAGE);
   if (!SPIFFS.begin(true)) {
     DEBUG_LOGN("-- ERROR: SPIFFS Mount Failed!");
   }
 
-  // Fresh start on first boot
+  // RTC memory was lost (power-on or reset), but the log on flash survived it
   if (bootCount == 0) {
-    SPIFFS.format();
+    SPIFFS.remove(OVERFLOW_FILE); // Its devices were tracked by the lost RTC table
+    loadLogState();
     checkSPIFFS();
   }
+  phaseTimer.switchTo(previousPhase);
 }
 
 void logBootInfo() {
@@ -536,40 +1557,143 @@ void logBootInfo() {
   DEBUG_LOGN(" ms");
 }
 
-void performBluetoothScan(unsigned long currentTime) {
+int performBluetoothScan(unsigned long currentTime) {
   BluetoothScanner scanner = BluetoothScanner(currentTime, lastUploadDuration);
+  int previousPhase = phaseTimer.switchTo(PHASE_BLE_INIT);
   scanner.initBluetooth();
+  phaseTimer.switchTo(PHASE_SCAN);
   scanner.performScan();
+  phaseTimer.switchTo(PHASE_BLE_INIT);
+  BLEDevice::deinit(true); // Done with BLE until the next boot, hand its memory back for Wi-Fi
+  phaseTimer.switchTo(PHASE_FLASH_WRITE); // Whatever the storage task has left to write
+  int peersSeen = scanner.waitForStorage();
+  phaseTimer.switchTo(previousPhase);
+  return peersSeen;
 }
 
-// Upload data every 5th boot cycle to save battery
+// Upload data when the upload policy says so, Wi-Fi is the biggest energy cost
 void uploadDataIfNeeded(WifiDataSender& wifiSender, unsigned long currentTime) {
-  if (bootCount > 0 && bootCount % 5 == 0) {
-    String data = readData(DATA_FILE);
+  const char* trigger = getUploadTrigger();
+  if (trigger) {
+    DEBUG_LOGF("-- LOG: Uploading, trigger: %s\n", trigger);
+    flushData(); // The upload covers everything logged so far
+    uint32_t uploadEnd = logHeadPosition;
+    uint32_t totalLength = LOG_MAGIC_LENGTH + uploadEnd - logCommitPosition;
+    if (uploadStreamId == 0) {
+      uploadStreamId = esp_random(); // New log, new stream
+      uploadAckedOffset = 0;
+    }
     unsigned long uploadStart = millis();
     
-    // Add timestamp info to upload
-    String uploadInfo = "# Upload Timestamp: " + String(currentTime) + "\n";
-    String dataWithMetadata = uploadInfo + data;
+    // Add timestamp info and the stats of the boots since the last upload. The server pairs
+    // both sides of a contact on the logged device numbers, our rolling IDs, so no address
+    // goes with it.
+    char uploadInfo[512];
+    size_t infoLength = snprintf(uploadInfo, sizeof(uploadInfo), "# Upload Timestamp: %lu\n", currentTime);
+    BootPhaseTimer::format(uploadInfo + infoLength, sizeof(uploadInfo) - infoLength);
     
-    if (wifiSender.uploadData(dataWithMetadata)) {
+    int previousPhase = phaseTimer.switchTo(PHASE_UPLOAD);
+    bool uploaded = wifiSender.uploadData(uploadInfo, readLogForUpload, totalLength, uploadStreamId, uploadAckedOffset);
+    closeLogReader();
+    phaseTimer.switchTo(previousPhase);
+
+    if (uploaded) {
       lastUploadDuration = millis() - uploadStart;
       DEBUG_LOG("-- LOG: Upload completed in ");
       DEBUG_LOG(lastUploadDuration);
       DEBUG_LOGN(" ms");
       
-      SPIFFS.format(); // Clear data after successful upload
+      commitLog(uploadEnd); // Only moves the pointer, a torn upload resumes from the same stream
+      uploadStreamId = 0;
+      uploadAckedOffset = 0;
+      oldestPendingTime = 0;
+      exposurePending = false;
+      uploadFailures = 0;
+      bootStatsCount = 0; // Reported
+      overflowDropCount = 0;
     } else {
       DEBUG_LOGN("-- ERROR: Upload failed");
+      backOffUpload();
+    }
+  }
+}
+
+// Is a peer still in close contact and about to cross the exposure threshold?
+bool isExposureApproaching(unsigned long currentTime) {
+  for (int slot = 0; slot < TRACKED_TABLE_SIZE; slot++) {
+    const TrackedContact& contact = trackedDevices[slot];
+    if (!contact.used || !wasSeenThisBoot(slot) || contact.lastCloseContactTime == 0) continue;
+    unsigned long closeTime = getExposureCloseTime(slot) + (currentTime - contact.lastCloseContactTime);
+    if (closeTime < EXPOSURE_TIME_THRESHOLD && closeTime + EXPOSURE_APPROACH_WINDOW >= EXPOSURE_TIME_THRESHOLD) {
+      return true;
     }
   }
+  return false;
 }
 
-void enterDeepSleep() {
+// Pick how long to sleep from what this scan saw, without overspending the energy budget
+uint32_t scheduleNextWake(int peersSeen, unsigned long currentTime) {
+  // Settle this cycle against the budget: it earned the budget for its whole length
+  // and spent what it drew awake plus what the sleep before it drew
+  uint32_t awakeMs = esp_timer_get_time() / 1000;
+  int64_t awakeCharge = phaseTimer.getBootCharge(); // uAs, from the phase current figures
+  int64_t earned = (int64_t)ENERGY_BUDGET_UA * (sleepInterval * 1000 + awakeMs) / 1000;
+  int64_t spent = awakeCharge + (int64_t)sleepInterval * SLEEP_CURRENT_UA;
+  energyCredit = constrain(energyCredit + earned - spent, (int64_t)INT32_MIN,
+                           (int64_t)ENERGY_BUDGET_UA * ENERGY_CREDIT_SECONDS);
+
+  // Follow the activity
+  uint32_t interval;
+  if (isExposureApproaching(currentTime)) {
+    interval = MIN_SLEEP_TIME_SECONDS; // Don't miss the moment it becomes an exposure
+  } else if (peersSeen > 0) {
+    interval = SLEEP_TIME_SECONDS;
+  } else {
+    interval = min(max(sleepInterval, (uint32_t)SLEEP_TIME_SECONDS) * 2, (uint32_t)MAX_SLEEP_TIME_SECONDS); // Alone, back off
+  }
+
+  // Out of credit: sleep long enough that a cycle like this one averages out to the budget
+  if (energyCredit <= 0) {
+    int64_t overspend = awakeCharge - (int64_t)ENERGY_BUDGET_UA * awakeMs / 1000;
+    uint32_t budgetInterval = (overspend > 0) ? overspend / (ENERGY_BUDGET_UA - SLEEP_CURRENT_UA) + 1 : 0;
+    interval = max(interval, budgetInterval);
+  }
+
+  DEBUG_LOGF("-- LOG: %d peers seen, energy credit %ld uAs, next wake in %lu s\n",
+             peersSeen, (long)energyCredit, (unsigned long)interval);
+  sleepInterval = interval;
+  return interval;
+}
+
+// Runs from RTC memory on every deep sleep wake, before the bootloader. Only RTC
+// memory and ROM/RTC code may be used here, so the tick length is a constant
+// (a 64-bit multiply at run time would call into flash).
+void RTC_IRAM_ATTR wakeStub() {
+  esp_default_wake_deep_sleep();
+  if (wakeStubSkips > 0) {
+    wakeStubSkips--;
+    esp_wake_stub_set_wakeup_time((uint64_t)WAKE_STUB_TICK_SECONDS * SECONDS_TO_MICROSECONDS);
+    esp_wake_stub_sleep(&wakeStub); // Doesn't return
+  }
+}
+
+void enterDeepSleep(uint32_t sleepSeconds) {
+  phaseTimer.switchTo(PHASE_SLEEP_ENTRY);
+  flushData(); // Nothing buffered may be lost to the sleep
+  phaseTimer.save(sleepSeconds); // Before bootCount moves on
   bootCount++;
-  esp_sleep_enable_timer_wakeup(SLEEP_TIME_SECONDS * SECONDS_TO_MICROSECONDS);
-  DEBUG_LOGN("-- LOG: Entering deep sleep for " + String(SLEEP_TIME_SECONDS) + " seconds");
-  delay(100);
+
+  // Whole ticks after the first one go to the wake stub, the first takes the remainder
+  uint32_t firstSleep = sleepSeconds;
+#if WAKE_STUB
+  wakeStubSkips = (sleepSeconds - 1) / WAKE_STUB_TICK_SECONDS;
+  firstSleep = sleepSeconds - wakeStubSkips * WAKE_STUB_TICK_SECONDS;
+  esp_set_deep_sleep_wake_stub(&wakeStub);
+#endif
+  esp_sleep_enable_timer_wakeup((uint64_t)firstSleep * SECONDS_TO_MICROSECONDS);
+  DEBUG_LOGF("-- LOG: Entering deep sleep for %lu seconds (%lu wake stub ticks)\n", (unsigned long)sleepSeconds,
+             (unsigned long)wakeStubSkips);
+  Serial.flush(); // Let the log out before the UART powers down
   esp_deep_sleep_start();
 }
 
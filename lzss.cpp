@@ -0,0 +1,104 @@
+// LZSS codec for upload chunks, see lzss.h
+#include <string.h>
+#include "lzss.h"
+
+#define LZSS_HASH_SIZE 256
+#define LZSS_CHAIN_LIMIT 32 // Candidates tried per position, bounds the time per chunk
+#define LZSS_NO_POSITION 0xFFFF
+
+#ifdef ARDUINO
+#define LZSS_THREAD_LOCAL
+#else
+#define LZSS_THREAD_LOCAL thread_local // bench/tracker_tune compresses on every core
+#endif
+
+// Most recent position per hash of the next LZSS_MIN_MATCH bytes, and the one before each
+static LZSS_THREAD_LOCAL uint16_t lzssHead[LZSS_HASH_SIZE];
+static LZSS_THREAD_LOCAL uint16_t lzssPrevious[LZSS_MAX_INPUT];
+
+static uint8_t lzssHash(const uint8_t* in) {
+  return (in[0] * 33 + in[1]) * 33 + in[2];
+}
+
+size_t lzssCompress(const uint8_t* in, size_t length, uint8_t* out, size_t capacity) {
+  if (length > LZSS_MAX_INPUT) {
+    return 0;
+  }
+  memset(lzssHead, 0xFF, sizeof(lzssHead));
+
+  size_t outLength = 0;
+  size_t flagIndex = 0;
+  int item = 8;
+  size_t position = 0;
+  while (position < length) {
+    if (item == 8) {
+      if (outLength >= capacity) return 0;
+      flagIndex = outLength++;
+      out[flagIndex] = 0;
+      item = 0;
+    }
+
+    // Longest earlier match among the most recent candidates
+    size_t bestLength = 0;
+    size_t bestDistance = 0;
+    if (position + LZSS_MIN_MATCH <= length) {
+      size_t limit = length - position < LZSS_MAX_MATCH ? length - position : LZSS_MAX_MATCH;
+      int chain = LZSS_CHAIN_LIMIT;
+      for (uint16_t candidate = lzssHead[lzssHash(in + position)]; candidate != LZSS_NO_POSITION && chain-- > 0;
+           candidate = lzssPrevious[candidate]) {
+        size_t matched = 0;
+        while (matched < limit && in[candidate + matched] == in[position + matched]) matched++;
+        if (matched > bestLength) {
+          bestLength = matched;
+          bestDistance = position - candidate;
+          if (matched == limit) break;
+        }
+      }
+    }
+
+    if (bestLength >= LZSS_MIN_MATCH) {
+      if (outLength + 2 > capacity) return 0;
+      out[outLength++] = (bestDistance - 1) & 0xFF;
+      out[outLength++] = ((bestDistance - 1) >> 8) << 4 | (bestLength - LZSS_MIN_MATCH);
+    } else {
+      if (outLength + 1 > capacity) return 0;
+      out[flagIndex] |= 1 << item;
+      out[outLength++] = in[position];
+      bestLength = 1;
+    }
+    item++;
+
+    // Every position the item covered becomes a candidate for later ones
+    for (size_t end = position + bestLength; position < end; position++) {
+      if (position + LZSS_MIN_MATCH > length) continue;
+      uint8_t hash = lzssHash(in + position);
+      lzssPrevious[position] = lzssHead[hash];
+      lzssHead[hash] = position;
+    }
+  }
+  return outLength;
+}
+
+size_t lzssDecompress(const uint8_t* in, size_t length, uint8_t* out, size_t capacity) {
+  size_t outLength = 0;
+  size_t position = 0;
+  while (position < length) {
+    uint8_t flags = in[position++];
+    for (int item = 0; item < 8 && position < length; item++) {
+      if (flags & (1 << item)) {
+        if (outLength >= capacity) return 0;
+        out[outLength++] = in[position++];
+        continue;
+      }
+      if (position + 2 > length) return 0;
+      size_t distance = (in[position] | (in[position + 1] >> 4) << 8) + 1;
+      size_t matchLength = (in[position + 1] & 0x0F) + LZSS_MIN_MATCH;
+      position += 2;
+      if (distance > outLength || outLength + matchLength > capacity) return 0;
+      for (size_t i = 0; i < matchLength; i++, outLength++) {
+        out[outLength] = out[outLength - distance];
+      }
+    }
+  }
+  return outLength;
+}
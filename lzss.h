@@ -0,0 +1,25 @@
+// Small LZSS codec for upload chunks (see UPLOAD_FLAG_LZSS). Each chunk is compressed
+// on its own, so chunks can still be resent and reassembled in any order, and the
+// server decodes them as they arrive. Contact records repeat the same few peer MACs
+// and event/duration bytes, which a window the size of a chunk already catches.
+//
+// Format: a flag byte for every 8 items, LSB first, bit set = literal byte, clear = match
+// of two bytes, (distance - 1) low 8 bits, then (distance - 1) >> 8 in the high nibble
+// and length - LZSS_MIN_MATCH in the low nibble. Matches can overlap what they copy.
+#ifndef LZSS_H
+#define LZSS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZSS_MIN_MATCH 3
+#define LZSS_MAX_MATCH 18 // LZSS_MIN_MATCH + 15
+#define LZSS_MAX_INPUT 1024 // Largest chunk, sizes the hash chains (2.5 kB of static RAM)
+
+// Returns the compressed length, 0 if it wouldn't fit in capacity (send it raw then)
+size_t lzssCompress(const uint8_t* in, size_t length, uint8_t* out, size_t capacity);
+
+// Returns the decompressed length, 0 if the input is corrupt or doesn't fit in capacity
+size_t lzssDecompress(const uint8_t* in, size_t length, uint8_t* out, size_t capacity);
+
+#endif // !LZSS_H
@@ -2,7 +2,7 @@
 
 const char* SSID = "Pixel_6616"; // Your WiFi / Network SSID (e.g. "Dalhousie University")
 const char* PASSWORD = "raj123456789"; // Your WiFi / Network Password (e.g. "password123")
-const char* UDP_ADDRESS = "10.12.4.247"; // Start the UDP server in the server project, it will print IP in console log, use this IP
+const char* UDP_ADDRESS = "10.12.4.247"; // Start the UDP server in the server project, it will print IP in console log, use this IP (or a DNS name for all your gateways)
 #define UDP_PORT 3333
 
 #endif // !SECRETS_H
\ No newline at end of file
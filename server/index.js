@@ -1,8 +1,12 @@
 // This code is part of a Node.js UDP server that receives data from ESP32 devices, processes it, and saves it to files.
 const dgram = require('dgram');
+const http = require('http');
 const os = require('os');
 const fs = require('fs');
 const path = require('path');
+const cluster = require('cluster');
+const crypto = require('crypto');
+const { Worker, isMainThread, parentPort } = require('worker_threads');
 
 // Get local IP address (IPv4)
 // This function retrieves the local IPv4 address of the machine
@@ -20,54 +24,282 @@ function getLocalIP() {
   return '127.0.0.1'; // fallback
 }
 
-const LOCAL_IP = getLocalIP();
-const PORT = 3333;
+// Gateway settings come from config.json next to this file (or --config <file>), see
+// config.example.json. Without one, a single process listens on the first interface.
+function loadConfig() {
+  const flag = process.argv.indexOf('--config');
+  const file = flag >= 0 ? process.argv[flag + 1] : path.join(__dirname, 'config.json');
+  const config = fs.existsSync(file) ? JSON.parse(fs.readFileSync(file, 'utf8')) : {};
+  const localIP = getLocalIP();
+  const listenAddress = !config.listenAddress || config.listenAddress === 'auto' ? localIP : config.listenAddress;
+  const port = config.port || 3333;
+  const node = config.node || 'local';
+  return {
+    listenAddress,
+    port,
+    queryPort: Number(process.env.QUERY_PORT) || config.queryPort || 8080,
+    processes: config.processes === 0 ? os.cpus().length : config.processes || 1,
+    dataDir: path.resolve(__dirname, config.dataDir || 'received_data'),
+    virtualNodes: config.virtualNodes || 128,
+    node,
+    // Every gateway, this one included, each running `processes` storage shards
+    nodes: config.nodes || [{ name: node, address: listenAddress, port }],
+  };
+}
+
+const CONFIG = loadConfig();
+const LOCAL_IP = CONFIG.listenAddress;
+const PORT = CONFIG.port;
+
+// Ingest pipeline: uploads are ACKed once the journal has them on disk, parsed on a worker pool
+// and written to the device files in batches. Per-upload logging only with --verbose.
+const VERBOSE = process.argv.includes('--verbose') || process.env.VERBOSE === '1';
+const INGEST_WORKERS = Number(process.env.INGEST_WORKERS) || Math.max(1, Math.floor(os.cpus().length / CONFIG.processes) - 1);
+const INGEST_FLUSH_BYTES = 64 * 1024; // Per device file, flush early once this much is buffered
+const INGEST_FLUSH_MS = 1000; // Otherwise everything buffered is written this often
+const INGEST_METRICS_MS = 10 * 1000; // How often to print packets/sec while traffic comes in
+const JOURNAL_SEGMENT_BYTES = 16 * 1024 * 1024; // Start a new journal file past this, saved ones are deleted
+
+// Contact store queries, see the HTTP server in the router
+const QUERY_PORT = CONFIG.queryPort;
+const QUERY_MAX_ROWS = 10000; // Per response unless ?limit= says otherwise
+const QUERY_TIMEOUT_MS = 10 * 1000; // A shard or gateway that hasn't answered by then is left out
+const STORE_MAX_LOADED_PARTITIONS = 256; // Partitions kept in memory with their indexes
+
+// Cross-device contact pairing, see pair_join.js
+const { PairJoin, PAIR_RETENTION_MS, PAIRS_HEADER } = require('./pair_join');
 
 // Create data directory if it doesn't exist
 // This directory will store the received data files from ESP32 devices
 // It checks if the directory exists, and if not, it creates it
-// The directory is named 'received_data' and is located in the same directory as this script
-const DATA_DIR = path.join(__dirname, 'received_data');
-if (!fs.existsSync(DATA_DIR)) {
-  fs.mkdirSync(DATA_DIR);
+// The directory is 'received_data' next to this script unless the config says otherwise,
+// with a shard<n> directory per storage shard when this gateway runs more than one
+const DATA_DIR = process.env.SHARD_DATA_DIR || CONFIG.dataDir;
+fs.mkdirSync(DATA_DIR, { recursive: true });
+
+// Uploads not yet written to the device files, replayed on restart (see UploadJournal)
+const LEGACY_JOURNAL_FILE = path.join(DATA_DIR, 'ingest.journal');
+const JOURNAL_SEGMENT_PATTERN = /^ingest-(\d+)\.journal$/;
+const journalSegmentFile = (offset) => path.join(DATA_DIR, `ingest-${offset}.journal`);
+const CHECKPOINT_FILE = path.join(DATA_DIR, 'ingest.checkpoint');
+const COMPLETED_UPLOADS_FILE = path.join(DATA_DIR, 'completed_uploads.json'); // See completedUploads
+
+// Joined contacts of the pairs this shard owns
+const PAIRS_FILE = path.join(DATA_DIR, 'contact_pairs.csv');
+
+// Columnar contact store, store/<YYYY-MM-DD>/<device>/<column>.bin (see ContactStore)
+const STORE_DIR = path.join(DATA_DIR, 'store');
+
+// Binary contact log sent by the ESP32 (see constants.h for the layout)
+// The firmware no longer stores CSV, so rows are rebuilt here before saving
+const LOG_MAGIC = Buffer.from('CTB1');
+const LOG_RECORD_SESSION = 0x00;
+const LOG_RECORD_CONTACT = 0x01;
+const LOG_RECORD_PADDING = 0x02; // Fills the end of a flash segment on the device
+const LOG_RECORD_TYPE_MASK = 0x0f;
+const LOG_EVENT_SHIFT = 4;
+const LOG_FLAG_EXPOSURE = 0x80;
+// Why the device wrote a contact record, indexed by the event bits of its tag
+const LOG_EVENTS = ['sighting', 'first_seen', 'close_start', 'close_end', 'exposure', 'summary'];
+const CSV_HEADER = 'timeStamp,peerId,rssi,deviceId,uploadDuration,contactDuration,closeContactDuration,exposureStatus,event';
+
+// Read a LEB128 varint, returns [value, nextOffset]
+function readVarint(buf, offset) {
+  let value = 0;
+  let shift = 0;
+  while (offset < buf.length) {
+    const byte = buf[offset++];
+    value += (byte & 0x7f) * 2 ** shift;
+    if ((byte & 0x80) === 0) return [value, offset];
+    shift += 7;
+  }
+  throw new RangeError('Truncated varint');
 }
 
-const server = dgram.createSocket('udp4');
+function encodeVarint(value) {
+  const bytes = [];
+  for (; value >= 0x80; value = Math.floor(value / 0x80)) bytes.push((value % 0x80) | 0x80);
+  bytes.push(value);
+  return Buffer.from(bytes);
+}
 
-server.on('error', (err) => {
-  console.log(`Server error:\n${err.stack}`);
-  server.close();
-});
+// Decode binary log records into CSV rows (without header). If there was a session record,
+// end gets what the next record would be decoded against: { lastTime, deviceNumber, uploadDuration }.
+function decodeContactLog(buf, end = {}) {
+  const rows = [];
+  let offset = 0;
+  let deviceId = 'N/A';
+  let deviceNumber = null;
+  let uploadDuration = 0;
+  let lastTime = 0;
+
+  try {
+    while (offset < buf.length) {
+      const tag = buf[offset++];
+      const type = tag & LOG_RECORD_TYPE_MASK;
+
+      if (type === LOG_RECORD_PADDING) {
+        continue;
+      } else if (type === LOG_RECORD_SESSION) {
+        lastTime = buf.readUInt32LE(offset);
+        deviceNumber = buf.readUInt32LE(offset + 4);
+        deviceId = 'ESP32_' + String(deviceNumber).padStart(8, '0');
+        [uploadDuration, offset] = readVarint(buf, offset + 8);
+      } else if (type === LOG_RECORD_CONTACT) {
+        const peerId = Array.from(buf.subarray(offset, offset + 6), (b) => b.toString(16).padStart(2, '0')).join(':');
+        const rssi = buf.readInt8(offset + 6);
+        let delta, contactDuration, closeContactDuration;
+        [delta, offset] = readVarint(buf, offset + 7);
+        [contactDuration, offset] = readVarint(buf, offset);
+        [closeContactDuration, offset] = readVarint(buf, offset);
+        lastTime += delta;
+        const exposureStatus = (tag & LOG_FLAG_EXPOSURE) ? 'EXPOSURE' : 'NORMAL';
+        const event = LOG_EVENTS[(tag & ~LOG_FLAG_EXPOSURE) >> LOG_EVENT_SHIFT] || 'unknown';
+        rows.push(`${lastTime},${peerId},${rssi},${deviceId},${uploadDuration},${contactDuration},${closeContactDuration},${exposureStatus},${event}`);
+      } else {
+        console.log(`⚠️  WARNING: Unknown log record type ${type} at byte ${offset - 1}, dropping the rest`);
+        break;
+      }
+    }
+  } catch (err) {
+    console.log(`⚠️  WARNING: Truncated log record (${err.message}), dropping the rest`);
+  }
+  if (deviceNumber !== null) Object.assign(end, { lastTime, deviceNumber, uploadDuration });
+  return rows;
+}
+
+// A session record that makes the records following it decode as if they came after the log decodeContactLog() ended at
+function resumeSessionRecord({ lastTime, deviceNumber, uploadDuration }) {
+  const record = Buffer.alloc(9);
+  record[0] = LOG_RECORD_SESSION;
+  record.writeUInt32LE(lastTime, 1);
+  record.writeUInt32LE(deviceNumber, 5);
+  return Buffer.concat([record, encodeVarint(uploadDuration)]);
+}
+
+// "# Boot Stats: boots=<n> first=<boot> sleep=<s>s dropped=<peers> <phase>=<us>us/<uAs>uAs ...", the
+// device's per-phase time and estimated charge summed over the boots since its last upload, and
+// how many tracked peers it lost from a full overflow store meanwhile
+const BOOT_STATS_PREFIX = '# Boot Stats:';
+
+// "# Upload Stream: <stream id hex> <total length>", put in front of a chunked upload's header
+// before it's journaled, so a replay knows which stream the device completed
+const UPLOAD_STREAM_PREFIX = '# Upload Stream:';
+const UPLOAD_STREAM_LINE = new RegExp(`^${UPLOAD_STREAM_PREFIX} ([0-9a-f]+) (\\d+)\n`);
+
+function parseBootStats(line) {
+  const stats = { boots: 0, first: 0, sleepSeconds: 0, droppedPeers: 0, phases: {} };
+  for (const field of line.slice(BOOT_STATS_PREFIX.length).trim().split(/\s+/)) {
+    const [name, value] = field.split('=');
+    const phase = /^(\d+)us\/(\d+)uAs$/.exec(value || '');
+    if (phase) {
+      stats.phases[name] = { micros: Number(phase[1]), charge: Number(phase[2]) };
+    } else if (name === 'boots') {
+      stats.boots = Number(value);
+    } else if (name === 'first') {
+      stats.first = Number(value);
+    } else if (name === 'sleep') {
+      stats.sleepSeconds = parseInt(value, 10);
+    } else if (name === 'dropped') {
+      stats.droppedPeers = Number(value) || 0;
+    }
+  }
+  return stats;
+}
+
+// One row per upload in device_<ip>_boot_stats.csv, columns fixed by the first upload's phases
+function saveBootStats(stats, uploadTimestamp, rinfo) {
+  const filePath = path.join(DATA_DIR, `device_${rinfo.address.replace(/\./g, '_')}_boot_stats.csv`);
+  const phases = Object.keys(stats.phases);
+  const columns = phases.flatMap((name) => [`${name}_us`, `${name}_uAs`]);
+  const header = ['uploadTimestamp', 'boots', 'firstBoot', 'sleepSeconds', ...columns].join(',');
+  const values = phases.flatMap((name) => [stats.phases[name].micros, stats.phases[name].charge]);
+  getWriter(filePath, header).append([uploadTimestamp || '', stats.boots, stats.first, stats.sleepSeconds, ...values].join(',') + '\n');
+}
+
+// Turn an upload into CSV text: text header lines, then the binary log if present
+function payloadToText(msg, logEnd) {
+  const logStart = msg.indexOf(LOG_MAGIC);
+  if (logStart < 0) {
+    return msg.toString(); // Older firmware sends CSV directly
+  }
+  const header = msg.subarray(0, logStart).toString();
+  const rows = decodeContactLog(msg.subarray(logStart + LOG_MAGIC.length), logEnd);
+  return header + [CSV_HEADER, ...rows].join('\n');
+}
+
+// Contacts travel from the parse workers to the store packed as fixed size rows:
+// uint32 time, 6 byte peer, int8 rssi, uint32 contact and close contact duration, flags
+// (LOG_FLAG_EXPOSURE | event index, 0x0f = unknown)
+const CONTACT_ROW_SIZE = 20;
+const CONTACT_EVENT_UNKNOWN = 0x0f;
+
+// Devices advertise rolling IDs from random addresses and log their peers by the start of
+// the peer's rolling ID. A row's deviceId is the start of the reporter's own, so both
+// sides of a contact pair on the first PAIR_ID_BYTES of the two IDs.
+const PAIR_ID_BYTES = 4;
+
+// A deviceId as the bytes its peers log it with, null if it isn't one
+function pairIdOf(deviceId) {
+  const number = Number(deviceId);
+  if (!Number.isInteger(number) || number <= 0 || number > 0xffffffff) return null;
+  const id = Buffer.alloc(PAIR_ID_BYTES);
+  id.writeUInt32LE(number);
+  return id.toString('hex');
+}
+
+function packContact(parts) {
+  const peer = /^([0-9a-f]{2}):([0-9a-f]{2}):([0-9a-f]{2}):([0-9a-f]{2}):([0-9a-f]{2}):([0-9a-f]{2})$/i.exec(parts[1]);
+  const time = Number(parts[0]);
+  if (!peer || !(time > 0 && time <= 0xffffffff)) return null;
+  const row = Buffer.alloc(CONTACT_ROW_SIZE);
+  row.writeUInt32LE(time, 0);
+  for (let i = 0; i < 6; i++) row[4 + i] = parseInt(peer[i + 1], 16);
+  row.writeInt8(Math.max(-128, Math.min(127, parseInt(parts[2]) || 0)), 10);
+  row.writeUInt32LE(Math.min(Number(parts[5]) || 0, 0xffffffff), 11);
+  row.writeUInt32LE(Math.min(Number(parts[6]) || 0, 0xffffffff), 15);
+  const event = LOG_EVENTS.indexOf(parts[8]);
+  row[19] = (parts[7] === 'EXPOSURE' ? LOG_FLAG_EXPOSURE : 0) | (event >= 0 ? event : CONTACT_EVENT_UNKNOWN);
+  return row;
+}
+
+// UTC day a row goes into
+function dayOf(time) {
+  return new Date(time * 1000).toISOString().slice(0, 10);
+}
+
+// Validate one complete upload and pull out what gets saved, runs on the parse workers.
+// The per-line printout only gets built with --verbose.
+function parseUpload(payload, address) {
+  const logEnd = {};
+  const data = payloadToText(payload, logEnd).replace(UPLOAD_STREAM_LINE, '').trim();
+  const result = {
+    data, validEntries: 0, uploadTimestamp: null, bootStats: null, csvHeader: null, contacts: {}, sightings: {}, log: [],
+    logEnd: logEnd.deviceNumber !== undefined ? logEnd : null,
+  };
+  const contacts = {}; // day -> packed rows
+  const sightings = {}; // Reporter's pair ID -> packed rows
+  const log = VERBOSE ? (line) => result.log.push(line) : () => {};
+
+  log(`\n=== Data received from ESP32 device ${address} ===`);
+  log('Raw data:');
+  log(data);
 
-// This event is triggered when the server receives a message from a client (ESP32 device)
-server.on('message', (msg, rinfo) => {
-  console.log(`\n=== Data received from ESP32 device ${rinfo.address}:${rinfo.port} ===`);
-  
-  const data = msg.toString().trim();
-  console.log('Raw data:');
-  console.log(data);
-  
   // Handle empty data case
   if (!data || data.length === 0) {
-    console.log('⚠️  WARNING: Received empty data packet!');
-    console.log('This could mean:');
-    console.log('  1. ESP32 is not in upload cycle (bootCount % 5 != 0)');
-    console.log('  2. No Bluetooth scan data collected yet');
-    console.log('  3. SPIFFS file system is empty');
-    console.log('===============================================\n');
-    
-    // Still send ACK for empty packets
-    server.send('ACK', rinfo.port, rinfo.address);
-    return;
+    log('⚠️  WARNING: Received empty data packet!');
+    log('This could mean:');
+    log('  1. Older firmware uploading outside its upload cycle (bootCount % 5 != 0)');
+    log('  2. No Bluetooth scan data collected yet');
+    log('  3. SPIFFS file system is empty');
+    log('===============================================\n');
+    return result;
   }
-  
+
   // Parse CSV data - now supports both old and new formats
   const lines = data.split('\n');
-  console.log('\nParsed BLE contact data:');
-  
-  let validEntries = 0;
-  let uploadTimestamp = null;
-  
+  log('\nParsed BLE contact data:');
+
   // Iterate through each line of the received data
   // Skip empty lines and handle comments or headers appropriately
   // Extract timestamp, peerId, rssi, deviceId, and uploadDuration if available
@@ -75,23 +307,38 @@ server.on('message', (msg, rinfo) => {
   // Count valid entries and handle upload timestamp comments
   lines.forEach((line, index) => {
     const trimmedLine = line.trim();
-    
+
     // Skip empty lines
     if (!trimmedLine) return;
-    
+
     // Handle upload timestamp comment
     if (trimmedLine.startsWith('# Upload Timestamp:')) {
-      uploadTimestamp = trimmedLine.split(':')[1].trim();
-      console.log(`Upload Timestamp: ${uploadTimestamp} (${new Date(parseInt(uploadTimestamp) * 1000).toISOString()})`);
+      result.uploadTimestamp = trimmedLine.split(':')[1].trim();
+      log(`Upload Timestamp: ${result.uploadTimestamp} (${new Date(parseInt(result.uploadTimestamp) * 1000).toISOString()})`);
       return;
     }
-    
+
+    // Handle boot stats comment
+    if (trimmedLine.startsWith(BOOT_STATS_PREFIX)) {
+      const bootStats = result.bootStats = parseBootStats(trimmedLine);
+      const awakeCharge = Object.values(bootStats.phases).reduce((sum, phase) => sum + phase.charge, 0);
+      log(`Boot Stats: ${bootStats.boots} boots from #${bootStats.first}, ${bootStats.sleepSeconds} s asleep, ~${(awakeCharge / 3600).toFixed(2)} uAh awake`);
+      if (bootStats.droppedPeers > 0) {
+        console.log(`⚠️  WARNING: Device ${address} dropped ${bootStats.droppedPeers} tracked peers from a full overflow store`);
+      }
+      for (const [name, phase] of Object.entries(bootStats.phases)) {
+        log(`  ${name.padEnd(12)} ${(phase.micros / 1000).toFixed(1).padStart(10)} ms ${(phase.charge / 3600).toFixed(2).padStart(10)} uAh`);
+      }
+      return;
+    }
+
     // Skip CSV headers
     if (trimmedLine.includes('timeStamp,peerId,rssi')) {
-      console.log(`CSV Header detected: ${trimmedLine}`);
+      result.csvHeader = result.csvHeader || trimmedLine;
+      log(`CSV Header detected: ${trimmedLine}`);
       return;
     }
-    
+
     // Parse data lines
     const parts = trimmedLine.split(',');
     if (parts.length >= 3) {
@@ -100,74 +347,1207 @@ server.on('message', (msg, rinfo) => {
       const rssi = parts[2];
       const deviceId = parts[3] || 'N/A';
       const uploadDuration = parts[4] || 'N/A';
-      
+
       // Validate timestamp
       const timestampNum = parseInt(timestamp);
       if (isNaN(timestampNum) || timestampNum <= 0) {
-        console.log(`Entry ${index}: Invalid timestamp: ${timestamp}`);
+        log(`Entry ${index}: Invalid timestamp: ${timestamp}`);
         return;
       }
-      
-      const date = new Date(timestampNum * 1000);
-      if (parts.length >= 5) {
-        // New format with deviceId and uploadDuration
-        console.log(`Entry ${index}: Time: ${date.toISOString()}, Peer ID: ${peerId}, RSSI: ${rssi} dBm, Device: ${deviceId}, Duration: ${uploadDuration}ms`);
-      } else {
-        // Old format
-        console.log(`Entry ${index}: Time: ${date.toISOString()}, Peer ID: ${peerId}, RSSI: ${rssi} dBm`);
+
+      if (VERBOSE) {
+        const date = new Date(timestampNum * 1000);
+        if (parts.length >= 5) {
+          // New format with deviceId and uploadDuration
+          log(`Entry ${index}: Time: ${date.toISOString()}, Peer ID: ${peerId}, RSSI: ${rssi} dBm, Device: ${deviceId}, Duration: ${uploadDuration}ms`);
+        } else {
+          // Old format
+          log(`Entry ${index}: Time: ${date.toISOString()}, Peer ID: ${peerId}, RSSI: ${rssi} dBm`);
+        }
+      }
+      result.validEntries++;
+      const row = packContact(parts);
+      if (row) {
+        (contacts[dayOf(timestampNum)] ||= []).push(row);
+        const reporter = pairIdOf(deviceId);
+        if (reporter) (sightings[reporter] ||= []).push(row);
       }
-      validEntries++;
     }
   });
-  
-  console.log(`\nTotal valid entries: ${validEntries}`);
-  if (uploadTimestamp) {
-    console.log(`Upload completed at: ${new Date(parseInt(uploadTimestamp) * 1000).toISOString()}`);
+  for (const [day, rows] of Object.entries(contacts)) result.contacts[day] = Buffer.concat(rows);
+  for (const [reporter, rows] of Object.entries(sightings)) result.sightings[reporter] = Buffer.concat(rows);
+
+  log(`\nTotal valid entries: ${result.validEntries}`);
+  if (result.uploadTimestamp) {
+    log(`Upload completed at: ${new Date(parseInt(result.uploadTimestamp) * 1000).toISOString()}`);
+  }
+  log('===============================================\n');
+  return result;
+}
+
+// Parse workers just run parseUpload(), everything below is the main thread's
+if (!isMainThread) {
+  parentPort.on('message', (job) => {
+    parentPort.postMessage({ seq: job.seq, result: parseUpload(Buffer.from(job.payload), job.address) });
+  });
+  return;
+}
+
+// Horizontal ingest. The router (cluster primary) owns the UDP socket and the query
+// port; the storage shards are cluster workers, `processes` of them per gateway. Each
+// device address hashes onto a ring of every gateway's shards, so its upload streams
+// always reach the same shard whichever gateway received them. Packets for a shard on
+// another gateway go there wrapped as "CF", uint16 port, uint8 address length, device
+// address, then the packet, and the shard there answers the device directly.
+// Forwarded packets and pair sightings are only taken from the addresses in CONFIG.nodes,
+// anyone else could claim to speak for any device.
+const FORWARD_MAGIC = 'CF';
+const PAIR_SIGHTINGS_MAX_BYTES = 1024 * 1024; // A whole device log's rows, base64 in JSON, fit with room to spare
+const GATEWAY_ADDRESSES = new Set(CONFIG.nodes.map((node) => node.address));
+
+function isGateway(address) {
+  return GATEWAY_ADDRESSES.has(address.replace(/^::ffff:/, ''));
+}
+
+class HashRing {
+  constructor(shards, virtualNodes) {
+    this.points = [];
+    for (const shard of shards) {
+      for (let i = 0; i < virtualNodes; i++) {
+        this.points.push({ hash: HashRing.hash(`${shard.name}#${i}`), shard });
+      }
+    }
+    this.points.sort((a, b) => a.hash - b.hash);
+  }
+
+  static hash(key) {
+    return crypto.createHash('md5').update(key).digest().readUInt32BE(0);
+  }
+
+  // First shard clockwise from the key
+  lookup(key) {
+    const hash = HashRing.hash(key);
+    let low = 0;
+    let high = this.points.length;
+    while (low < high) {
+      const mid = (low + high) >> 1;
+      if (this.points[mid].hash < hash) low = mid + 1; else high = mid;
+    }
+    return this.points[low % this.points.length].shard;
+  }
+}
+
+function shardsOf(node) {
+  return Array.from({ length: CONFIG.processes }, (_, index) => ({ name: `${node.name}/${index}`, node, index }));
+}
+
+function wrapForwarded(msg, rinfo) {
+  const address = Buffer.from(rinfo.address);
+  const header = Buffer.alloc(5);
+  header.write(FORWARD_MAGIC, 0, 'latin1');
+  header.writeUInt16LE(rinfo.port, 2);
+  header[4] = address.length;
+  return Buffer.concat([header, address, msg]);
+}
+
+function unwrapForwarded(msg) {
+  const end = 5 + msg[4];
+  return [msg.subarray(end), { address: msg.toString('utf8', 5, end), port: msg.readUInt16LE(2) }];
+}
+
+// Query every shard of this gateway, and with fleet set the other gateways too, then
+// merge their rows in time order. One that exits, fails or times out answers null.
+function queryFleet(shardWorkers, params, fleet) {
+  const requests = [...shardWorkers].map(([index, worker]) => new Promise((resolve) => {
+    const id = crypto.randomUUID();
+    const done = (result) => {
+      clearTimeout(timer);
+      worker.off('message', onMessage);
+      worker.off('exit', onExit);
+      resolve(result);
+    };
+    const onMessage = (message) => {
+      if (message.type === 'queryResult' && message.id === id) done(message.result);
+    };
+    const onExit = () => done(null);
+    const timer = setTimeout(() => {
+      console.log(`Query to shard ${index} timed out`);
+      done(null);
+    }, QUERY_TIMEOUT_MS);
+    worker.on('message', onMessage);
+    worker.on('exit', onExit);
+    worker.send({ type: 'query', id, params }, (err) => { if (err) done(null); });
+  }));
+  if (fleet) {
+    for (const node of CONFIG.nodes) {
+      if (node.name === CONFIG.node) continue;
+      const search = new URLSearchParams({ ...params, scope: 'gateway' });
+      requests.push(new Promise((resolve) => {
+        const url = `http://${node.address}:${node.queryPort || QUERY_PORT}${params.path}?${search}`;
+        http.get(url, { timeout: QUERY_TIMEOUT_MS }, (res) => {
+          let body = '';
+          res.on('data', (chunk) => body += chunk);
+          res.on('end', () => { try { resolve(JSON.parse(body)); } catch { resolve(null); } });
+          res.on('error', () => resolve(null));
+        }).on('timeout', function () {
+          this.destroy(new Error('timed out'));
+        }).on('error', (err) => {
+          console.log(`Query to gateway ${node.name} failed: ${err.message}`);
+          resolve(null);
+        });
+      }));
+    }
+  }
+  return Promise.all(requests).then((results) => {
+    const merged = { partitions: 0, truncated: false, rows: [] };
+    for (const result of results) {
+      if (!result || result.error) continue;
+      merged.partitions += result.partitions;
+      merged.truncated ||= result.truncated;
+      merged.rows.push(...result.rows);
+    }
+    merged.rows.sort((a, b) => a.timeStamp - b.timeStamp);
+    const limit = Number(params.limit) || QUERY_MAX_ROWS;
+    merged.truncated ||= merged.rows.length > limit;
+    merged.rows = merged.rows.slice(0, limit);
+    return merged;
+  });
+}
+
+// Key a contact's two sides hash on, the same whichever device reported it
+function pairKey(idA, idB) {
+  return idA < idB ? `${idA}-${idB}` : `${idB}-${idA}`;
+}
+
+// Split a device's packed contact rows by the shard owning each pair and send them
+// there, over IPC for our own shards and to the other gateway's query port otherwise
+function routeSightings(ring, shardWorkers, reporter, rows) {
+  const byShard = new Map(); // shard name -> { shard, rows }
+  for (let offset = 0; offset + CONTACT_ROW_SIZE <= rows.length; offset += CONTACT_ROW_SIZE) {
+    const peer = rows.toString('hex', offset + 4, offset + 4 + PAIR_ID_BYTES);
+    if (peer === reporter) continue;
+    const shard = ring.lookup(`pair:${pairKey(reporter, peer)}`);
+    if (!byShard.has(shard.name)) byShard.set(shard.name, { shard, rows: [] });
+    byShard.get(shard.name).rows.push(rows.subarray(offset, offset + CONTACT_ROW_SIZE));
+  }
+  for (const { shard, rows: shardRows } of byShard.values()) {
+    const packed = Buffer.concat(shardRows);
+    if (shard.node.name === CONFIG.node) {
+      shardWorkers.get(shard.index).send({ type: 'pairSightings', reporter, rows: packed });
+      continue;
+    }
+    const body = JSON.stringify({ reporter, rows: packed.toString('base64') });
+    const req = http.request(`http://${shard.node.address}:${shard.node.queryPort || QUERY_PORT}/pair-sightings`, {
+      method: 'POST',
+      headers: { 'Content-Type': 'application/json', 'Content-Length': Buffer.byteLength(body) },
+    }, (res) => res.resume());
+    req.on('error', (err) => console.log(`Pair sightings to gateway ${shard.node.name} failed: ${err.message}`));
+    req.end(body);
+  }
+}
+
+function startRouter() {
+  const ring = new HashRing(CONFIG.nodes.flatMap(shardsOf), CONFIG.virtualNodes);
+  const shardWorkers = new Map(); // shard index -> cluster worker
+  let stopping = false;
+
+  cluster.setupPrimary({ serialization: 'advanced' }); // Buffers go over IPC as is
+  const fork = (index) => {
+    const dataDir = CONFIG.processes > 1 ? path.join(CONFIG.dataDir, `shard${index}`) : CONFIG.dataDir;
+    const worker = cluster.fork({ SHARD_INDEX: index, SHARD_DATA_DIR: dataDir });
+    worker.on('message', (message) => {
+      if (message.type === 'reply') {
+        server.send(message.text, message.port, message.address);
+      } else if (message.type === 'sightings') {
+        const rows = Buffer.from(message.rows.buffer, message.rows.byteOffset, message.rows.length);
+        routeSightings(ring, shardWorkers, message.reporter, rows);
+      }
+    });
+    worker.on('exit', () => {
+      if (stopping) return;
+      console.log(`Shard ${index} exited, restarting it`);
+      fork(index);
+    });
+    shardWorkers.set(index, worker);
+  };
+  for (let index = 0; index < CONFIG.processes; index++) fork(index);
+
+  const server = dgram.createSocket('udp4');
+  server.on('error', (err) => {
+    console.log(`Server error:\n${err.stack}`);
+    server.close();
+  });
+
+  server.on('message', (msg, rinfo) => {
+    let device = rinfo;
+    let forwarded = false;
+    if (msg.length >= 5 && msg.toString('latin1', 0, 2) === FORWARD_MAGIC) {
+      if (!isGateway(rinfo.address)) {
+        if (VERBOSE) console.log(`Dropped a forwarded packet from ${rinfo.address}, not a gateway`);
+        return;
+      }
+      [msg, device] = unwrapForwarded(msg);
+      forwarded = true;
+    }
+    const shard = ring.lookup(device.address);
+    if (shard.node.name !== CONFIG.node && !forwarded) {
+      server.send(wrapForwarded(msg, rinfo), shard.node.port || PORT, shard.node.address);
+      return;
+    }
+    // A forwarded packet stays here even if our ring disagrees, rather than bounce around
+    const worker = shardWorkers.get(shard.node.name === CONFIG.node ? shard.index : HashRing.hash(shard.name) % CONFIG.processes);
+    worker.send({ type: 'packet', msg, address: device.address, port: device.port });
+  });
+
+  // This event is triggered when the server starts listening for incoming messages
+  server.on('listening', () => {
+    const address = server.address();
+    console.log(`UDP server listening on ${address.address}:${address.port}, gateway ${CONFIG.node} with ${CONFIG.processes} shard(s) ` +
+      `of ${CONFIG.nodes.length * CONFIG.processes}, ${INGEST_WORKERS} parse workers each${VERBOSE ? ', verbose' : ''}`);
+  });
+  server.bind(PORT, LOCAL_IP);
+
+  // Contact store queries over HTTP, answered as JSON:
+  //   GET /contacts?peer=<mac>&device=<ip>&from=<unix time>&to=<unix time>&limit=<rows>
+  //   GET /exposures?...  the same, only rows flagged EXPOSURE
+  // Every parameter is optional. "Who was near X between T1 and T2" is
+  // /contacts?device=X&from=T1&to=T2 for what X logged, or /contacts?peer=X&... for what
+  // the other devices logged about X. Any gateway answers for the whole fleet.
+  // Gateways also POST each other /pair-sightings here for pairs whose shard we hold.
+  const queryServer = http.createServer((req, res) => {
+    const url = new URL(req.url, 'http://localhost');
+    const reply = (status, body) => {
+      res.writeHead(status, { 'Content-Type': 'application/json' });
+      res.end(JSON.stringify(body));
+    };
+    if (req.method === 'POST' && url.pathname === '/pair-sightings') {
+      if (!isGateway(req.socket.remoteAddress)) {
+        reply(403, { error: 'Only gateways send pair sightings' });
+        return;
+      }
+      if (Number(req.headers['content-length']) > PAIR_SIGHTINGS_MAX_BYTES) {
+        reply(413, { error: `Pair sightings are limited to ${PAIR_SIGHTINGS_MAX_BYTES} bytes` });
+        return;
+      }
+      let body = '';
+      req.on('data', (chunk) => {
+        body += chunk;
+        if (body.length > PAIR_SIGHTINGS_MAX_BYTES) req.destroy(); // Content-Length lied
+      });
+      req.on('end', () => {
+        try {
+          const { reporter, rows } = JSON.parse(body);
+          const packed = Buffer.from(typeof rows === 'string' ? rows : '', 'base64');
+          if (typeof reporter !== 'string' || reporter.length !== 2 * PAIR_ID_BYTES || !/^[0-9a-f]+$/.test(reporter) ||
+              packed.length === 0 || packed.length % CONTACT_ROW_SIZE !== 0) {
+            throw new Error('Expected a reporter pair ID in hex and packed contact rows');
+          }
+          const peer = packed.toString('hex', 4, 4 + PAIR_ID_BYTES);
+          const shard = ring.lookup(`pair:${pairKey(reporter, peer)}`);
+          // Like forwarded packets, keep it here even if our ring disagrees
+          const index = shard.node.name === CONFIG.node ? shard.index : HashRing.hash(shard.name) % CONFIG.processes;
+          shardWorkers.get(index).send({ type: 'pairSightings', reporter, rows: packed });
+          reply(200, { ok: true });
+        } catch (err) {
+          reply(400, { error: err.message });
+        }
+      });
+      return;
+    }
+    if (req.method !== 'GET' || !['/contacts', '/exposures'].includes(url.pathname)) {
+      reply(404, { error: 'Use GET /contacts or GET /exposures' });
+      return;
+    }
+    const params = Object.fromEntries(url.searchParams);
+    if (params.peer !== undefined && params.peer.toLowerCase().replace(/[^0-9a-f]/g, '').length !== 12) {
+      reply(400, { error: 'peer must be a 6 byte peer ID like cc:ba:97:e2:ae:b6' });
+      return;
+    }
+    for (const name of ['from', 'to', 'limit']) {
+      const value = Number(params[name]);
+      if (params[name] !== undefined && !(Number.isInteger(value) && value >= 0 && value <= 0xffffffff)) {
+        reply(400, { error: `${name} must be a whole number from 0 to ${0xffffffff}` });
+        return;
+      }
+    }
+    const started = process.hrtime.bigint();
+    queryFleet(shardWorkers, { ...params, path: url.pathname }, params.scope !== 'gateway').then((result) => {
+      result.ms = Number(process.hrtime.bigint() - started) / 1e6;
+      reply(200, result);
+    });
+  });
+  queryServer.on('listening', () => {
+    console.log(`Contact queries on http://${LOCAL_IP}:${QUERY_PORT}/contacts and /exposures`);
+  });
+  queryServer.on('error', (err) => console.log(`Query server error: ${err.message}`));
+  queryServer.listen(QUERY_PORT, LOCAL_IP);
+
+  // Let the shards save what's buffered before going down
+  for (const signal of ['SIGINT', 'SIGTERM']) {
+    process.on(signal, () => {
+      if (stopping) return; // A second Ctrl-C while the shards flush
+      stopping = true;
+      server.close();
+      queryServer.close();
+      for (const worker of shardWorkers.values()) worker.process.kill('SIGTERM');
+      cluster.on('exit', () => {
+        if (Object.keys(cluster.workers).length === 0) process.exit(0);
+      });
+    });
+  }
+}
+
+if (cluster.isPrimary) {
+  startRouter();
+  return;
+}
+
+// Everything below runs in the storage shards
+const SHARD_INDEX = Number(process.env.SHARD_INDEX);
+
+// Appends to one file through a cached handle. Writes are batched and go out one at a
+// time, so the file sees them in append order; sync() also gets them onto the disk.
+class BufferedFile {
+  constructor(filePath, header) {
+    this.filePath = filePath;
+    this.header = header; // Written first if the file is new
+    this.chunks = [];
+    this.bytes = 0;
+    this.fd = null;
+    this.writing = Promise.resolve();
+    this.inFlight = 0;
+    this.unsynced = false; // Written since the last sync()
+    this.failed = null; // A write error since the last sync()
+  }
+
+  // Nothing buffered, being written or waiting for a sync
+  get idle() {
+    return this.bytes === 0 && this.inFlight === 0 && !this.unsynced;
+  }
+
+  append(data) {
+    const chunk = Buffer.isBuffer(data) ? data : Buffer.from(data);
+    this.chunks.push(chunk);
+    this.bytes += chunk.length;
+    if (this.bytes >= INGEST_FLUSH_BYTES) this.flush();
+  }
+
+  // Resolves once everything appended so far is written
+  flush() {
+    if (this.bytes > 0) {
+      const data = Buffer.concat(this.chunks);
+      this.chunks = [];
+      this.bytes = 0;
+      this.inFlight++;
+      this.writing = this.writing.then(() => this._write(data)).catch((err) => {
+        console.error(`Error saving to ${this.filePath}:`, err.message);
+        this.failed = err;
+      }).finally(() => this.inFlight--);
+    }
+    return this.writing;
+  }
+
+  async _write(data) {
+    if (this.fd === null) {
+      this.fd = await fs.promises.open(this.filePath, 'a');
+      if (this.header && (await this.fd.stat()).size === 0) {
+        if (VERBOSE) console.log(`Creating new data file: ${path.basename(this.filePath)}`);
+        data = Buffer.concat([Buffer.from(this.header + '\n'), data]);
+      }
+    }
+    await this.fd.write(data);
+    this.unsynced = true;
+  }
+
+  // Resolves once everything appended so far is on disk, rejects if some of it never got there
+  async sync() {
+    await this.flush();
+    if (this.failed) {
+      const err = this.failed;
+      this.failed = null;
+      throw err; // The journal still has it, the checkpoint mustn't move past
+    }
+    if (this.unsynced) {
+      this.unsynced = false;
+      await this.fd.datasync();
+    }
+  }
+
+  close() {
+    if (this.fd !== null) this.fd.close().catch(() => {});
+    this.fd = null;
+  }
+}
+
+const writers = new Map();
+
+function getWriter(filePath, header) {
+  let writer = writers.get(filePath);
+  if (!writer) {
+    writer = new BufferedFile(filePath, header);
+    writers.set(filePath, writer);
+  }
+  return writer;
+}
+
+// Contacts partitioned by UTC day and reporting device, one append-only file per
+// column so an index rebuild only reads the columns it needs:
+//   time.bin uint32, peer.bin 6 byte peer ID, rssi.bin int8, contact.bin uint32,
+//   close.bin uint32, flags.bin uint8 (LOG_FLAG_EXPOSURE | event index)
+// A partition is loaded into memory with its indexes the first time it's written or
+// queried; after that this process keeps memory and files in step itself.
+// packedAt is the column's offset in a packContact() row.
+const STORE_COLUMNS = [
+  { name: 'time', size: 4, packedAt: 0, read: (b, o) => b.readUInt32LE(o) },
+  { name: 'peer', size: 6, packedAt: 4, read: (b, o) => b.toString('hex', o, o + 6) },
+  { name: 'rssi', size: 1, packedAt: 10, read: (b, o) => b.readInt8(o) },
+  { name: 'contact', size: 4, packedAt: 11, read: (b, o) => b.readUInt32LE(o) },
+  { name: 'close', size: 4, packedAt: 15, read: (b, o) => b.readUInt32LE(o) },
+  { name: 'flags', size: 1, packedAt: 19, read: (b, o) => b[o] },
+];
+
+// Index of the first row in rows (sorted by time) at or after the time
+function lowerBound(rows, times, time) {
+  let low = 0;
+  let high = rows.length;
+  while (low < high) {
+    const mid = (low + high) >> 1;
+    if (times[rows[mid]] < time) low = mid + 1; else high = mid;
+  }
+  return low;
+}
+
+// Keep rows sorted by time, appends are nearly always in order
+function insertByTime(rows, times, row) {
+  if (rows.length === 0 || times[rows[rows.length - 1]] <= times[row]) {
+    rows.push(row);
+  } else {
+    rows.splice(lowerBound(rows, times, times[row] + 1), 0, row);
+  }
+}
+
+class StorePartition {
+  constructor(day, device) {
+    this.day = day;
+    this.device = device;
+    this.dir = path.join(STORE_DIR, day, device);
+    this.columns = Object.fromEntries(STORE_COLUMNS.map((column) => [column.name, []]));
+    this.byPeer = new Map(); // peer hex -> rows sorted by time
+    this.exposures = []; // Rows with the exposure flag, sorted by time
+    this.lastUsed = Date.now();
+    this.load();
+  }
+
+  load() {
+    let count = Infinity;
+    const data = {};
+    for (const column of STORE_COLUMNS) {
+      const file = path.join(this.dir, `${column.name}.bin`);
+      data[column.name] = fs.existsSync(file) ? fs.readFileSync(file) : Buffer.alloc(0);
+      count = Math.min(count, Math.floor(data[column.name].length / column.size)); // A torn write leaves columns uneven
+    }
+    for (let row = 0; row < count; row++) {
+      for (const column of STORE_COLUMNS) {
+        this.columns[column.name].push(column.read(data[column.name], row * column.size));
+      }
+      this._index(row);
+    }
+  }
+
+  _index(row) {
+    const times = this.columns.time;
+    const peer = this.columns.peer[row];
+    if (!this.byPeer.has(peer)) this.byPeer.set(peer, []);
+    insertByTime(this.byPeer.get(peer), times, row);
+    if (this.columns.flags[row] & LOG_FLAG_EXPOSURE) insertByTime(this.exposures, times, row);
+  }
+
+  // Add packed contact rows (see packContact)
+  append(packed) {
+    const rows = packed.length / CONTACT_ROW_SIZE;
+    const first = this.columns.time.length;
+    for (const column of STORE_COLUMNS) {
+      const out = Buffer.alloc(rows * column.size);
+      for (let row = 0; row < rows; row++) {
+        const at = row * CONTACT_ROW_SIZE + column.packedAt;
+        packed.copy(out, row * column.size, at, at + column.size);
+        this.columns[column.name].push(column.read(out, row * column.size));
+      }
+      getWriter(path.join(this.dir, `${column.name}.bin`)).append(out);
+    }
+    for (let row = first; row < this.columns.time.length; row++) this._index(row);
+    this.lastUsed = Date.now();
+  }
+
+  row(row) {
+    const flags = this.columns.flags[row];
+    const event = flags & LOG_RECORD_TYPE_MASK;
+    return {
+      timeStamp: this.columns.time[row],
+      device: this.device,
+      peerId: this.columns.peer[row].match(/../g).join(':'),
+      rssi: this.columns.rssi[row],
+      contactDuration: this.columns.contact[row],
+      closeContactDuration: this.columns.close[row],
+      exposureStatus: (flags & LOG_FLAG_EXPOSURE) ? 'EXPOSURE' : 'NORMAL',
+      event: LOG_EVENTS[event] || 'unknown',
+    };
+  }
+
+  // Rows between from and to (inclusive), from the peer index, the exposure index or all of them
+  *find({ peer, exposedOnly, from, to }) {
+    this.lastUsed = Date.now();
+    const times = this.columns.time;
+    let rows;
+    if (peer) {
+      rows = this.byPeer.get(peer) || [];
+      if (exposedOnly) rows = rows.filter((row) => this.columns.flags[row] & LOG_FLAG_EXPOSURE);
+    } else if (exposedOnly) {
+      rows = this.exposures;
+    } else {
+      rows = times.map((_, row) => row).sort((a, b) => times[a] - times[b]);
+    }
+    for (let i = lowerBound(rows, times, from); i < rows.length && times[rows[i]] <= to; i++) {
+      yield rows[i];
+    }
+  }
+
+  // Can be dropped from memory once its column files are written out
+  get idle() {
+    return STORE_COLUMNS.every((column) => {
+      const writer = writers.get(path.join(this.dir, `${column.name}.bin`));
+      return !writer || writer.idle;
+    });
+  }
+
+  unload() {
+    for (const column of STORE_COLUMNS) {
+      const filePath = path.join(this.dir, `${column.name}.bin`);
+      const writer = writers.get(filePath);
+      if (writer) {
+        writer.close();
+        writers.delete(filePath);
+      }
+    }
+  }
+}
+
+class ContactStore {
+  constructor() {
+    fs.mkdirSync(STORE_DIR, { recursive: true });
+    this.partitions = new Map(); // "day/device" -> StorePartition
+    this.days = new Map(); // day -> Set of devices with a partition that day
+    for (const day of fs.readdirSync(STORE_DIR)) {
+      this.days.set(day, new Set(fs.readdirSync(path.join(STORE_DIR, day))));
+    }
+  }
+
+  _partition(day, device) {
+    const key = `${day}/${device}`;
+    let partition = this.partitions.get(key);
+    if (!partition) {
+      this._evict();
+      if (!this.days.has(day)) this.days.set(day, new Set());
+      if (!this.days.get(day).has(device)) {
+        fs.mkdirSync(path.join(STORE_DIR, day, device), { recursive: true });
+        this.days.get(day).add(device);
+      }
+      partition = new StorePartition(day, device);
+      this.partitions.set(key, partition);
+    }
+    return partition;
+  }
+
+  // Drop the least recently used partitions past the limit, unless they still have writes pending
+  _evict() {
+    if (this.partitions.size < STORE_MAX_LOADED_PARTITIONS) return;
+    const candidates = [...this.partitions.entries()].filter(([, p]) => p.idle).sort(([, a], [, b]) => a.lastUsed - b.lastUsed);
+    for (const [key, partition] of candidates.slice(0, this.partitions.size - STORE_MAX_LOADED_PARTITIONS + 1)) {
+      partition.unload();
+      this.partitions.delete(key);
+    }
+  }
+
+  append(day, device, packed) {
+    this._partition(day, device).append(packed);
+  }
+
+  // Matching rows in time order, across the days from..to and the given device or all of them
+  query({ device, peer, exposedOnly = false, from = 0, to = 0xffffffff, limit = QUERY_MAX_ROWS }) {
+    const firstDay = dayOf(from);
+    const lastDay = dayOf(Math.min(to, 0xffffffff));
+    const found = [];
+    let partitions = 0;
+    for (const day of [...this.days.keys()].sort()) {
+      if (day < firstDay || day > lastDay) continue;
+      for (const name of this.days.get(day)) {
+        if (device && name !== device) continue;
+        const partition = this._partition(day, name);
+        partitions++;
+        for (const row of partition.find({ peer, exposedOnly, from, to })) {
+          found.push(partition.row(row));
+        }
+      }
+    }
+    found.sort((a, b) => a.timeStamp - b.timeStamp);
+    return { partitions, truncated: found.length > limit, rows: found.slice(0, limit) };
   }
-  console.log('===============================================\n');
-  
+}
+
+// Store partitions are named after the reporting device's address like the CSV files
+function storeDeviceName(address) {
+  return `device_${address.replace(/[.:]/g, '_')}`;
+}
+
+const pairs = new Map(); // pairKey -> PairJoin
+
+// Feed one device's packed contact rows into the pairs they belong to
+function joinSightings(reporter, rows) {
+  const byPeer = new Map();
+  for (let offset = 0; offset + CONTACT_ROW_SIZE <= rows.length; offset += CONTACT_ROW_SIZE) {
+    const peer = rows.toString('hex', offset + 4, offset + 4 + PAIR_ID_BYTES);
+    if (!byPeer.has(peer)) byPeer.set(peer, []);
+    byPeer.get(peer).push({
+      time: rows.readUInt32LE(offset),
+      rssi: rows.readInt8(offset + 10),
+      exposure: (rows[offset + 19] & LOG_FLAG_EXPOSURE) !== 0,
+    });
+  }
+  const joined = [];
+  for (const [peer, samples] of byPeer) {
+    const key = pairKey(reporter, peer);
+    if (!pairs.has(key)) pairs.set(key, new PairJoin(...key.split('-')));
+    samples.sort((x, y) => x.time - y.time);
+    joined.push(...pairs.get(key).add(reporter, samples));
+  }
+  if (joined.length > 0) getWriter(PAIRS_FILE, PAIRS_HEADER).append(joined.join('\n') + '\n');
+}
+
+// Finish pairs that went quiet, merging whatever is left of them
+function expirePairs(now = Date.now()) {
+  const joined = [];
+  for (const [key, pair] of pairs) {
+    if (now - pair.updated < PAIR_RETENTION_MS) continue;
+    if (pair.sides[0].lastTime > 0 && pair.sides[1].lastTime > 0) joined.push(...pair.merge(Infinity));
+    pairs.delete(key);
+  }
+  if (joined.length > 0) getWriter(PAIRS_FILE, PAIRS_HEADER).append(joined.join('\n') + '\n');
+}
+
+// Every complete upload is appended here and synced to disk before it's ACKed, as
+// uint32 entry length, uint16 port, uint8 address length, address, upload bytes.
+// Offsets only grow. The journal is a run of segment files named after the offset they
+// start at, a new one is begun once the last is JOURNAL_SEGMENT_BYTES long. The
+// checkpoint file holds the offset up to which the device files have it all: segments
+// wholly before it are deleted, and a restart replays the rest, so a crash can repeat
+// rows but not lose them.
+class UploadJournal {
+  constructor() {
+    if (fs.existsSync(LEGACY_JOURNAL_FILE)) fs.renameSync(LEGACY_JOURNAL_FILE, journalSegmentFile(0)); // One file, from before segments
+    this.segments = fs.readdirSync(DATA_DIR).map((name) => JOURNAL_SEGMENT_PATTERN.exec(name))
+      .filter(Boolean).map((match) => Number(match[1])).sort((a, b) => a - b); // Start offsets
+    const last = this.segments[this.segments.length - 1];
+    this.size = last === undefined ? 0 : last + fs.statSync(journalSegmentFile(last)).size;
+    this.checkpoint = 0;
+    if (fs.existsSync(CHECKPOINT_FILE)) {
+      this.checkpoint = Math.min(Number(fs.readFileSync(CHECKPOINT_FILE, 'utf8')) || 0, this.size);
+    }
+    this.chunks = []; // Appended, not yet written
+    this.written = this.size;
+    this.fd = null; // Of the last segment, opened by the first write
+    this.torn = false; // A write failed, the next one starts a new segment
+    this.syncing = Promise.resolve(); // The write in progress
+    this.nextSync = null; // The one queued behind it, shared by everyone who asks meanwhile
+  }
+
+  // Returns the journal offset just past the entry, call sync() before ACKing it
+  append(payload, rinfo) {
+    const address = Buffer.from(rinfo.address);
+    const entry = Buffer.alloc(7 + address.length);
+    entry.writeUInt32LE(entry.length + payload.length, 0);
+    entry.writeUInt16LE(rinfo.port, 4);
+    entry[6] = address.length;
+    address.copy(entry, 7);
+    this.chunks.push(entry, payload);
+    this.size += entry.length + payload.length;
+    return this.size;
+  }
+
+  // Resolves once everything appended so far is on disk. Group commit: while one write
+  // and fdatasync run, the uploads arriving meanwhile wait for the next one together.
+  sync() {
+    if (!this.nextSync) {
+      this.nextSync = this.syncing.then(() => {
+        this.nextSync = null;
+        return this._write();
+      });
+      this.syncing = this.nextSync.catch(() => {});
+    }
+    return this.nextSync;
+  }
+
+  async _write() {
+    if (this.chunks.length === 0) return;
+    const data = Buffer.concat(this.chunks);
+    this.chunks = [];
+    try {
+      const last = this.segments[this.segments.length - 1];
+      if (this.fd === null && last !== undefined && !this.torn && this.written - last < JOURNAL_SEGMENT_BYTES) {
+        this.fd = await fs.promises.open(journalSegmentFile(last), 'a'); // Carry on with the last run's
+      } else if (this.fd === null || this.written - last >= JOURNAL_SEGMENT_BYTES) {
+        if (this.fd !== null) await this.fd.close();
+        this.fd = null;
+        if (last !== this.written) this.segments.push(this.written); // Or the torn one holds nothing whole, start it over
+        this.fd = await fs.promises.open(journalSegmentFile(this.written), 'w');
+        this.torn = false;
+      }
+      await this.fd.write(data);
+      await this.fd.datasync();
+      this.written += data.length;
+    } catch (err) {
+      // Whatever part made it in is a torn tail, try it all again in a fresh segment
+      this.chunks.unshift(data);
+      if (this.fd !== null) this.fd.close().catch(() => {});
+      this.fd = null;
+      this.torn = true;
+      throw err;
+    }
+  }
+
+  // Entries past the checkpoint, left over from the last run
+  *unsaved() {
+    for (let i = 0; i < this.segments.length; i++) {
+      const base = this.segments[i];
+      const end = i + 1 < this.segments.length ? this.segments[i + 1] : this.size;
+      if (end <= this.checkpoint) continue;
+      const segment = fs.readFileSync(journalSegmentFile(base));
+      const limit = Math.min(segment.length, end - base);
+      let offset = Math.max(this.checkpoint - base, 0);
+      while (offset + 7 <= limit) {
+        const length = segment.readUInt32LE(offset);
+        if (length < 7 || offset + length > limit) break;
+        const addressLength = segment[offset + 6];
+        yield {
+          rinfo: { address: segment.toString('utf8', offset + 7, offset + 7 + addressLength), port: segment.readUInt16LE(offset + 4) },
+          payload: segment.subarray(offset + 7 + addressLength, offset + length),
+          end: base + offset + length,
+        };
+        offset += length;
+      }
+      if (i === this.segments.length - 1 && base + offset < this.size) {
+        fs.truncateSync(journalSegmentFile(base), offset); // Torn last write, new entries go after the last whole one
+        this.size = this.written = base + offset;
+      }
+    }
+  }
+
+  // Everything up to offset is in the device files
+  async commit(offset) {
+    if (offset <= this.checkpoint) return;
+    this.checkpoint = offset;
+    await fs.promises.writeFile(CHECKPOINT_FILE, String(this.checkpoint));
+    while (this.segments.length > 1 && this.segments[1] <= this.checkpoint) {
+      await fs.promises.unlink(journalSegmentFile(this.segments.shift()));
+    }
+  }
+}
+
+// Runs parseUpload() off the event loop. Results come back in any order, but are
+// saved in arrival order so each device file stays in upload order.
+class ParsePool {
+  constructor(size, onResult) {
+    this.onResult = onResult;
+    this.jobs = new Map(); // seq -> job, until its result is back
+    this.workers = [];
+    this.next = 0;
+    for (let i = 0; i < size; i++) this._spawn(i);
+  }
+
+  _spawn(index) {
+    const worker = new Worker(__filename, { argv: process.argv.slice(2) });
+    worker.jobs = new Set();
+    worker.on('message', ({ seq, result }) => {
+      worker.jobs.delete(seq);
+      this.jobs.delete(seq);
+      this.onResult(seq, result);
+    });
+    worker.on('error', (err) => console.error(`Parse worker ${index} failed:`, err.message));
+    worker.on('exit', () => {
+      // Hand its unfinished jobs to a fresh worker
+      this._spawn(index);
+      for (const seq of worker.jobs) this._send(this.workers[index], this.jobs.get(seq));
+    });
+    worker.unref(); // Don't keep the process alive on our own
+    this.workers[index] = worker;
+  }
+
+  _send(worker, job) {
+    worker.jobs.add(job.seq);
+    worker.postMessage(job);
+  }
+
+  run(seq, payload, address) {
+    const job = { seq, payload, address };
+    this.jobs.set(seq, job);
+    // Least busy worker, round robin between equals
+    let best = null;
+    for (let i = 0; i < this.workers.length; i++) {
+      const worker = this.workers[(this.next + i) % this.workers.length];
+      if (!best || worker.jobs.size < best.jobs.size) best = worker;
+    }
+    this.next = (this.next + 1) % this.workers.length;
+    this._send(best, job);
+  }
+
+  get queued() {
+    return this.jobs.size;
+  }
+}
+
+const journal = new UploadJournal();
+const store = new ContactStore();
+const parsed = new Map(); // seq -> { result, rinfo, end }, waiting for earlier uploads
+const uploads = new Map(); // seq -> { rinfo, end }, sent to the pool
+let nextSeq = 0;
+let nextSave = 0;
+let savedJournalOffset = journal.checkpoint;
+const metrics = { packets: 0, uploads: 0, rows: 0, since: Date.now() };
+
+const pool = new ParsePool(INGEST_WORKERS, (seq, result) => {
+  parsed.set(seq, { result, ...uploads.get(seq) });
+  uploads.delete(seq);
+  while (parsed.has(nextSave)) {
+    const upload = parsed.get(nextSave);
+    parsed.delete(nextSave++);
+    saveUpload(upload.result, upload.rinfo);
+    savedJournalOffset = upload.end;
+    const completed = completedUploads.get(upload.rinfo.address);
+    if (completed && completed.end === upload.end) completed.logEnd = upload.result.logEnd;
+  }
+});
+
+// Queue a complete upload for parsing and saving, journaling it first unless it came from the journal.
+// Returns the journal offset just past it.
+function ingestUpload(payload, rinfo, journalEnd = journal.append(payload, rinfo)) {
+  const seq = nextSeq++;
+  uploads.set(seq, { rinfo: { address: rinfo.address, port: rinfo.port }, end: journalEnd });
+  pool.run(seq, payload, rinfo.address);
+  metrics.uploads++;
+  return journalEnd;
+}
+
+// Buffer a parsed upload's rows for its device files
+function saveUpload(result, rinfo) {
+  for (const line of result.log) console.log(line);
+  metrics.rows += result.validEntries;
+
+  if (result.bootStats) {
+    saveBootStats(result.bootStats, result.uploadTimestamp, rinfo);
+  }
+
+  for (const [day, packed] of Object.entries(result.contacts)) {
+    store.append(day, storeDeviceName(rinfo.address), Buffer.from(packed.buffer, packed.byteOffset, packed.length));
+  }
+
+  // Both sides of a contact meet on the shard owning the pair, the router sends them there
+  for (const [reporter, packed] of Object.entries(result.sightings)) {
+    process.send({ type: 'sightings', reporter, rows: Buffer.from(packed.buffer, packed.byteOffset, packed.length) });
+  }
+
   // Only save to file if we have actual data
   // This prevents creating empty files or files with just headers
-  // It checks if there are valid entries before proceeding to save
   // Each device will have its own file named based on its IP address
   // The file will contain the parsed data in CSV format
-  if (validEntries > 0) {
-    // Save data to file (creates one file per device)
+  if (result.validEntries > 0) {
     const deviceFileName = `device_${rinfo.address.replace(/\./g, '_')}_data.csv`;
-    const filePath = path.join(DATA_DIR, deviceFileName);
-    
-    // Check if file exists and create header if it's a new file
-    const fileExists = fs.existsSync(filePath);
-    
-    if (!fileExists) {
-      console.log(`Creating new data file: ${deviceFileName}`);
-      // Create file with updated CSV header to match new format
-      const csvLines = data.split('\n');
-      const headerLine = csvLines.find(line => line.includes('timeStamp,peerId,rssi'));
-      const header = headerLine || 'timeStamp,peerId,rssi,deviceId,uploadDuration';
-      fs.writeFileSync(filePath, header + '\n');
-    }
-    
-    // Append data to device-specific file
-    fs.appendFile(filePath, data + '\n', (err) => {
-      if (err) {
-        console.error(`Error saving data from ${rinfo.address}:`, err.message);
-      } else {
-        console.log(`Data saved to: ${filePath}`);
-      }
-    });
-  } else {
+    const header = result.csvHeader || 'timeStamp,peerId,rssi,deviceId,uploadDuration';
+    getWriter(path.join(DATA_DIR, deviceFileName), header).append(result.data + '\n');
+  } else if (VERBOSE) {
     console.log('No valid data entries found - skipping file save');
   }
-  
-  // Send ACK response as expected by ESP32
-  server.send('ACK', rinfo.port, rinfo.address);
-});
+}
+
+// Write out every buffer and sync it, then move the journal checkpoint past what they held.
+// Not past what the journal itself has yet, the completed streams saved go by it.
+let flushing = null;
+function flushAll() {
+  if (!flushing) {
+    const offset = Math.min(savedJournalOffset, journal.written);
+    flushing = Promise.all([...writers.values()].map((writer) => writer.sync()))
+      .then(() => saveCompletedUploads(offset))
+      .then(() => journal.commit(offset))
+      .catch((err) => console.error('Error flushing ingest buffers:', err.message))
+      .finally(() => { flushing = null; });
+  }
+  return flushing;
+}
+setInterval(flushAll, INGEST_FLUSH_MS).unref();
+setInterval(expirePairs, 60 * 1000).unref();
+
+setInterval(() => {
+  const seconds = (Date.now() - metrics.since) / 1000;
+  if (metrics.packets > 0) {
+    console.log(`Ingest shard ${SHARD_INDEX}: ${(metrics.packets / seconds).toFixed(1)} packets/s, ${(metrics.uploads / seconds).toFixed(2)} uploads/s, ` +
+      `${(metrics.rows / seconds).toFixed(1)} rows/s, ${pool.queued} parsing`);
+  }
+  Object.assign(metrics, { packets: 0, uploads: 0, rows: 0, since: Date.now() });
+}, INGEST_METRICS_MS).unref();
+
+// Save what's buffered before going down
+let stopping = false;
+for (const signal of ['SIGINT', 'SIGTERM']) {
+  process.on(signal, () => {
+    if (stopping) return; // Ctrl-C reaches us directly and then again as the router's SIGTERM
+    stopping = true;
+    flushAll().then(() => process.exit(0));
+  });
+}
+
+// Answers go back out through the router's socket, so they come from the gateway's port
+function sendToDevice(text, rinfo) {
+  process.send({ type: 'reply', text, address: rinfo.address, port: rinfo.port });
+}
+
+// ACK an upload only once its journal entry is on disk. If the journal can't be written
+// there's no ACK, and the device keeps the data and tries again later.
+function ackWhenDurable(durable, ack, rinfo) {
+  durable.then(ack, (err) => console.error(`Error journaling the upload from ${rinfo.address}, not ACKing it:`, err.message));
+}
+
+// Chunked upload transport (see UPLOAD_* in the firmware)
+// Each stream is reassembled by byte offset and processed once the END packet confirms it is complete.
+// Every DATA packet is answered with the cumulative offset plus a SACK bitmap of chunks held past it,
+// so the device only resends what is actually missing.
+const UPLOAD_MAGIC = 'CU';
+const UPLOAD_HEADER_SIZE = 12;
+const UPLOAD_BEGIN_SIZE = 6;
+const UPLOAD_FLAG_LZSS = 0x01; // Offered on BEGIN, set on DATA packets whose chunk is compressed
+const UPLOAD_MAX_PENDING = 32; // Out-of-order chunks kept per stream, one SACK bit each
+const UPLOAD_SESSION_TIMEOUT_MS = 10 * 60 * 1000;
+const UPLOAD_COMPLETED_RETENTION_MS = 7 * 24 * 60 * 60 * 1000; // Only for devices that stop uploading altogether
+const uploadSessions = new Map();
+
+// The last stream each device completed, so a retried END (lost ACK) is confirmed again and
+// a retried BEGIN only sends what the device logged since. The device keeps the stream ID
+// until it gets the ACK, so the entry stays until a BEGIN for another stream. What the
+// journal has is saved to COMPLETED_UPLOADS_FILE before the checkpoint moves past it, the
+// rest comes back with the replay: a restart doesn't take the whole stream again either.
+// logEnd is where decoding the stream ended (see decodeContactLog), what the new bytes follow on from.
+const completedUploads = new Map(); // device address -> { streamId, totalLength, end, durable, logEnd, lastActivity }
+let savedCompletions = '';
+if (fs.existsSync(COMPLETED_UPLOADS_FILE)) {
+  for (const [address, completed] of Object.entries(JSON.parse(fs.readFileSync(COMPLETED_UPLOADS_FILE, 'utf8')))) {
+    completedUploads.set(address, { ...completed, end: 0, durable: Promise.resolve() });
+  }
+}
+
+// Those up to the journal offset, written to a temporary file and renamed over the old one
+async function saveCompletedUploads(offset) {
+  const saved = {};
+  for (const [address, { streamId, totalLength, end, logEnd, lastActivity }] of completedUploads) {
+    if (end <= offset) saved[address] = { streamId, totalLength, logEnd, lastActivity };
+  }
+  const text = JSON.stringify(saved);
+  if (text === savedCompletions) return;
+  const file = await fs.promises.open(`${COMPLETED_UPLOADS_FILE}.tmp`, 'w');
+  try {
+    await file.writeFile(text);
+    await file.datasync();
+  } finally {
+    await file.close();
+  }
+  await fs.promises.rename(`${COMPLETED_UPLOADS_FILE}.tmp`, COMPLETED_UPLOADS_FILE);
+  savedCompletions = text;
+}
+
+function expireUploadSessions() {
+  const now = Date.now();
+  for (const [key, session] of uploadSessions) {
+    if (now - session.lastActivity > UPLOAD_SESSION_TIMEOUT_MS) uploadSessions.delete(key);
+  }
+  for (const [address, completed] of completedUploads) {
+    if (now - completed.lastActivity > UPLOAD_COMPLETED_RETENTION_MS) completedUploads.delete(address);
+  }
+}
+
+// Add a chunk to the stream, keeping out-of-order ones until the gap is filled
+function acceptChunk(session, offset, payload) {
+  if (offset > session.received) {
+    if (session.pending.size < UPLOAD_MAX_PENDING) session.pending.set(offset, payload);
+    return;
+  }
+  if (offset + payload.length > session.received) {
+    session.chunks.push(payload.subarray(session.received - offset));
+    session.received = offset + payload.length;
+  }
+  for (const [pendingOffset, pendingPayload] of session.pending) {
+    if (pendingOffset <= session.received) {
+      session.pending.delete(pendingOffset);
+      acceptChunk(session, pendingOffset, pendingPayload);
+      return;
+    }
+  }
+}
+
+// Undo the firmware's per-chunk LZSS (see lzss.h): a flag byte per 8 items, bit set =
+// literal, clear = 12 bit distance - 1 and 4 bit length - 3 in two bytes.
+// Returns null for a corrupt chunk or one that inflates past maxLength.
+function lzssDecompress(input, maxLength) {
+  const out = Buffer.alloc(maxLength);
+  let length = 0;
+  let position = 0;
+  while (position < input.length) {
+    const flags = input[position++];
+    for (let item = 0; item < 8 && position < input.length; item++) {
+      if (flags & (1 << item)) {
+        if (length >= maxLength) return null;
+        out[length++] = input[position++];
+        continue;
+      }
+      if (position + 2 > input.length) return null;
+      const distance = (input[position] | (input[position + 1] >> 4) << 8) + 1;
+      const matchLength = (input[position + 1] & 0x0f) + 3;
+      position += 2;
+      if (distance > length || length + matchLength > maxLength) return null;
+      for (let i = 0; i < matchLength; i++, length++) out[length] = out[length - distance];
+    }
+  }
+  return out.subarray(0, length);
+}
+
+// Bit i set = we hold the chunk starting i chunks past the cumulative offset
+function selectiveAck(session) {
+  let sack = 0;
+  for (const pendingOffset of session.pending.keys()) {
+    const index = Math.floor((pendingOffset - session.received) / session.chunkSize);
+    if (index > 0 && index < 32) sack |= 1 << index;
+  }
+  return sack >>> 0;
+}
+
+function handleUploadPacket(msg, rinfo) {
+  const type = String.fromCharCode(msg[2]);
+  const streamId = msg.readUInt32LE(4);
+  const offset = msg.readUInt32LE(8);
+  const payload = msg.subarray(UPLOAD_HEADER_SIZE);
+  const key = `${rinfo.address}:${streamId}`;
+  const ack = (next, sack = 0, suffix = '') => sendToDevice(`ACK ${next} ${sack.toString(16)}${suffix}`, rinfo);
+  let session = uploadSessions.get(key);
+
+  let completed = completedUploads.get(rinfo.address);
+  if (completed && completed.streamId !== streamId) completed = null;
 
-// This event is triggered when the server starts listening for incoming messages
-server.on('listening', () => {
-  const address = server.address();
-  console.log(`UDP server listening on ${address.address}:${address.port}`);
+  if (type === 'B') {
+    expireUploadSessions();
+    if (completed) {
+      completed.lastActivity = Date.now();
+    } else if (completedUploads.has(rinfo.address)) {
+      completedUploads.delete(rinfo.address); // A new stream, so the device got our ACK for the old one
+    }
+    if (!session) {
+      // Without the earlier bytes we can't decode a resumed stream, so ask for all of it.
+      // The exception is a stream we already saved (its END ACK got lost): the device kept
+      // appending to it, so only take the new bytes, which start at a record boundary and
+      // carry on from the times the stream so far ended at.
+      const base = completed ? completed.totalLength : 0;
+      session = { chunks: [], pending: new Map(), received: base, base, resumes: completed ? completed.logEnd : null };
+      uploadSessions.set(key, session);
+    }
+    session.totalLength = payload.readUInt32LE(0);
+    session.chunkSize = payload.readUInt16LE(4);
+    session.header = payload.subarray(UPLOAD_BEGIN_SIZE).toString();
+    session.lzss = (msg[3] & UPLOAD_FLAG_LZSS) !== 0;
+    session.lastActivity = Date.now();
+    if (VERBOSE) {
+      console.log(`Upload stream ${streamId.toString(16)} from ${rinfo.address}: ${session.totalLength} bytes, resuming at ${session.received}` +
+        `${session.lzss ? ', compressed' : ''}`);
+    }
+    ack(session.received, 0, session.lzss ? ' lzss' : '');
+    return;
+  }
+
+  if (type === 'E' && !session && completed) {
+    ackWhenDurable(completed.durable, () => ack(completed.totalLength), rinfo);
+    return;
+  }
+
+  if (!session) {
+    sendToDevice('RST', rinfo); // Unknown stream, the device restarts it with BEGIN
+    return;
+  }
+  session.lastActivity = Date.now();
+
+  if (type === 'D') {
+    const chunk = msg[3] & UPLOAD_FLAG_LZSS ? lzssDecompress(payload, session.chunkSize) : payload;
+    if (chunk) {
+      acceptChunk(session, offset, chunk);
+    } else {
+      console.log(`Dropped a corrupt compressed chunk at ${offset} from ${rinfo.address}`); // The device resends it
+    }
+    ack(session.received, selectiveAck(session));
+  } else if (type === 'E') {
+    if (session.received < session.totalLength) {
+      ack(session.received);
+      return;
+    }
+    let log = Buffer.concat(session.chunks).subarray(0, session.totalLength - session.base);
+    if (session.base > 0) log = Buffer.concat([LOG_MAGIC, session.resumes ? resumeSessionRecord(session.resumes) : Buffer.alloc(0), log]);
+    uploadSessions.delete(key);
+    const stream = `${UPLOAD_STREAM_PREFIX} ${streamId.toString(16)} ${session.totalLength}\n`;
+    const end = ingestUpload(Buffer.concat([Buffer.from(stream + session.header), log]), rinfo);
+    const durable = journal.sync();
+    completedUploads.set(rinfo.address, { streamId, totalLength: session.totalLength, end, durable, lastActivity: Date.now() });
+    ackWhenDurable(durable, () => ack(session.totalLength), rinfo); // Saving it follows
+  }
+}
+
+// Packets the router sends this shard, and store queries
+process.on('message', (message) => {
+  if (message.type === 'packet') {
+    const msg = Buffer.from(message.msg.buffer, message.msg.byteOffset, message.msg.length);
+    const rinfo = { address: message.address, port: message.port };
+    metrics.packets++;
+    if (msg.length >= UPLOAD_HEADER_SIZE && msg.toString('latin1', 0, 2) === UPLOAD_MAGIC) {
+      handleUploadPacket(msg, rinfo);
+      return;
+    }
+
+    // Older firmware sends everything in one datagram and expects a plain ACK
+    ingestUpload(msg, rinfo);
+    ackWhenDurable(journal.sync(), () => sendToDevice('ACK', rinfo), rinfo);
+  } else if (message.type === 'query') {
+    const params = message.params;
+    const peer = params.peer ? params.peer.toLowerCase().replace(/[^0-9a-f]/g, '') : undefined;
+    const device = params.device;
+    let result;
+    try {
+      result = store.query({
+        device: device ? (device.startsWith('device_') ? device : storeDeviceName(device)) : undefined,
+        peer,
+        exposedOnly: params.path === '/exposures',
+        from: Number(params.from) || 0,
+        to: Number(params.to) || 0xffffffff,
+        limit: Number(params.limit) || QUERY_MAX_ROWS,
+      });
+    } catch (err) {
+      result = { error: err.message }; // Not worth taking the shard down over
+    }
+    process.send({ type: 'queryResult', id: message.id, result });
+  } else if (message.type === 'pairSightings') {
+    joinSightings(message.reporter, Buffer.from(message.rows.buffer, message.rows.byteOffset, message.rows.length));
+  }
 });
 
-server.bind(PORT, LOCAL_IP);
\ No newline at end of file
+// Uploads the last run ACKed but didn't get to save
+let replayed = 0;
+for (const entry of journal.unsaved()) {
+  ingestUpload(entry.payload, entry.rinfo, entry.end);
+  const stream = UPLOAD_STREAM_LINE.exec(entry.payload.toString('latin1', 0, 64));
+  if (stream) {
+    completedUploads.set(entry.rinfo.address, {
+      streamId: parseInt(stream[1], 16), totalLength: Number(stream[2]), end: entry.end, durable: Promise.resolve(), lastActivity: Date.now(),
+    });
+  }
+  replayed++;
+}
+if (replayed > 0) console.log(`Shard ${SHARD_INDEX}: replaying ${replayed} journaled uploads`);
@@ -0,0 +1,121 @@
+// Cross-device contact pairing. Both sides of each contact, keyed on the starts of the two
+// devices' rolling IDs (PAIR_ID_BYTES in index.js), are joined on the storage shard owning
+// the pair (see joinSightings). On its own file so test/ can load it without a server.
+const fs = require('fs');
+const path = require('path');
+
+// The distance and close contact model is the firmware's, read from its constants.h so the
+// two can't drift apart
+const MODEL = readDefines(path.join(__dirname, '..', 'constants.h'), ['PATH_LOSS_RSSI_AT_1M', 'PATH_LOSS_EXPONENT',
+  'CLOSE_CONTACT_ENTER_DISTANCE', 'CLOSE_CONTACT_EXIT_DISTANCE', 'EXPOSURE_TIME_THRESHOLD', 'LOG_SUMMARY_INTERVAL']);
+const PAIR_TOLERANCE_S = 60; // Two sides' samples this close in time are one observation
+const PAIR_MAX_GAP_S = MODEL.LOG_SUMMARY_INTERVAL + PAIR_TOLERANCE_S; // Longer without a sample breaks a close contact
+const PAIR_RETENTION_MS = 2 * 60 * 60 * 1000; // Pairs idle this long are finished and dropped
+const PAIR_CLOSE_ENTER_RSSI = rssiAt(MODEL.CLOSE_CONTACT_ENTER_DISTANCE);
+const PAIR_CLOSE_EXIT_RSSI = rssiAt(MODEL.CLOSE_CONTACT_EXIT_DISTANCE);
+const PAIRS_HEADER = 'timeStamp,deviceA,deviceB,rssiA,rssiB,filteredRssi,distance,closeContactDuration,exposureStatus,' +
+  'deviceAExposure,deviceBExposure,matched';
+
+// Streaming join of the two sides of each contact this shard owns. Each side's samples
+// (time, rssi, exposure flag from its packed rows) wait until the other side has
+// uploaded past them: everything up to the watermark min(last time A, last time B) -
+// PAIR_TOLERANCE_S can't get a partner any more, so it's merged in time order. A sample
+// with a partner on the other side within the tolerance counts as one observation at
+// their mean RSSI, one without stands alone. The RSSI the devices log is already
+// filtered, so the merged trace only goes through the firmware's distance, hysteresis
+// and close time rules (not its filter a second time), giving one agreed exposure
+// decision per pair, and every merged sample is a row in contact_pairs.csv.
+// Pairs are kept in memory, a restart starts their state over.
+class PairJoin {
+  constructor(idA, idB) {
+    this.ids = [idA, idB]; // Sorted, side 0 is deviceA
+    this.sides = [{ pending: [], lastTime: 0, exposure: false }, { pending: [], lastTime: 0, exposure: false }];
+    this.filteredRssi = null;
+    this.close = false;
+    this.closeSeconds = 0;
+    this.lastTime = 0; // Of the last merged sample
+    this.exposed = false;
+    this.updated = Date.now();
+  }
+
+  // Take a side's samples, which arrive in time order per device. Returns the merged rows.
+  add(reporter, samples) {
+    const side = this.sides[this.ids.indexOf(reporter)];
+    for (const sample of samples) {
+      if (sample.time <= side.lastTime) continue; // Replayed, this side has it already
+      side.pending.push(sample);
+      side.lastTime = sample.time;
+    }
+    this.updated = Date.now();
+    if (this.sides[0].lastTime === 0 || this.sides[1].lastTime === 0) return []; // Not reciprocal yet
+    return this.merge(Math.min(this.sides[0].lastTime, this.sides[1].lastTime) - PAIR_TOLERANCE_S);
+  }
+
+  // Merge everything up to the watermark (Infinity once the pair is done)
+  merge(watermark) {
+    const rows = [];
+    const [a, b] = this.sides.map((side) => side.pending);
+    while (a.length || b.length) {
+      const first = !b.length || (a.length && a[0].time <= b[0].time) ? 0 : 1;
+      const own = this.sides[first].pending;
+      const other = this.sides[1 - first].pending;
+      if (own[0].time > watermark) break;
+      const sample = own.shift();
+      const samples = [null, null];
+      samples[first] = sample;
+      if (other.length && other[0].time - sample.time <= PAIR_TOLERANCE_S) samples[1 - first] = other.shift();
+      rows.push(this.fold(samples));
+    }
+    return rows;
+  }
+
+  // Fold one observation (one sample per side, either may be missing) into the agreed state
+  fold(samples) {
+    samples.forEach((sample, i) => { if (sample) this.sides[i].exposure = sample.exposure; });
+    const present = samples.filter(Boolean);
+    const time = Math.min(...present.map((sample) => sample.time)); // The earlier one, so merged times never go backwards
+    // Devices log their filtered RSSI, so the mean of the two is used as it is
+    this.filteredRssi = present.reduce((sum, sample) => sum + sample.rssi, 0) / present.length;
+
+    const gap = Math.max(time - this.lastTime, 0);
+    if (this.close && this.lastTime > 0 && gap <= PAIR_MAX_GAP_S) this.closeSeconds += gap;
+    if (this.close ? this.filteredRssi < PAIR_CLOSE_EXIT_RSSI : this.filteredRssi >= PAIR_CLOSE_ENTER_RSSI) this.close = !this.close;
+    this.lastTime = time;
+
+    const exposed = this.closeSeconds >= MODEL.EXPOSURE_TIME_THRESHOLD;
+    if (exposed !== this.exposed) {
+      this.exposed = exposed;
+      console.log(`Agreed exposure ${exposed ? 'started' : 'ended'}: ${this.ids.map(formatId).join(' <-> ')} at ${time}, ` +
+        `${this.closeSeconds} s close (devices say ${this.sides.map((side) => side.exposure ? 'EXPOSURE' : 'NO_EXPOSURE').join('/')})`);
+    }
+    const distance = distanceAt(this.filteredRssi);
+    return [time, ...this.ids.map(formatId), samples[0] ? samples[0].rssi : '', samples[1] ? samples[1].rssi : '',
+      this.filteredRssi.toFixed(1), distance.toFixed(2), this.closeSeconds, exposed ? 'EXPOSURE' : 'NO_EXPOSURE',
+      ...this.sides.map((side) => side.exposure ? 'EXPOSURE' : 'NO_EXPOSURE'), samples[0] && samples[1] ? 1 : 0].join(',');
+  }
+}
+
+// Log-distance path loss model, rssi = PATH_LOSS_RSSI_AT_1M - 10 * n * log10(d)
+function distanceAt(rssi) {
+  return Math.pow(10, (MODEL.PATH_LOSS_RSSI_AT_1M - rssi) / (10 * MODEL.PATH_LOSS_EXPONENT));
+}
+
+function rssiAt(distance) {
+  return MODEL.PATH_LOSS_RSSI_AT_1M - 10 * MODEL.PATH_LOSS_EXPONENT * Math.log10(distance);
+}
+
+// Numeric "#define NAME value" lines of a C header, throws if one of names is missing
+function readDefines(file, names) {
+  const values = {};
+  for (const [, name, value] of fs.readFileSync(file, 'utf8').matchAll(/^\s*#define\s+(\w+)\s+(-?[\d.]+)\b/gm)) {
+    values[name] = Number(value);
+  }
+  for (const name of names) if (!Number.isFinite(values[name])) throw new Error(`${name} not found in ${file}`);
+  return values;
+}
+
+function formatId(hex) {
+  return hex.match(/../g).join(':');
+}
+
+module.exports = { PairJoin, PAIR_RETENTION_MS, PAIRS_HEADER };
@@ -0,0 +1,50 @@
+// Checks of the cross-device contact join (../pair_join.js). Run with `node --test` in server/.
+const test = require('node:test');
+const assert = require('node:assert');
+const { PairJoin } = require('../pair_join');
+
+const A = '0a000001';
+const B = '0b000002';
+
+function samples(times, rssi = -50) {
+  return times.map((time) => ({ time, rssi, exposure: false }));
+}
+
+// Merged rows as [time, closeContactDuration]
+function join(reports) {
+  const pair = new PairJoin(A, B);
+  const rows = [];
+  for (const [reporter, times] of reports) rows.push(...pair.add(reporter, samples(times)));
+  rows.push(...pair.merge(Infinity));
+  return rows.map((row) => row.split(',')).map((fields) => [Number(fields[0]), Number(fields[7])]);
+}
+
+test('merged times never go backwards when the sides report at different rates', () => {
+  // B's first sample pairs with A's, a later one of A's, while B keeps reporting in between
+  const rows = join([[B, [100, 105, 110, 115, 120]], [A, [110, 200, 300]]]);
+  assert.deepStrictEqual(rows.map(([time]) => time), [100, 105, 110, 115, 120, 200, 300]);
+  for (let i = 1; i < rows.length; i++) assert.ok(rows[i][1] >= rows[i - 1][1], `close time went down at row ${i}`);
+  assert.strictEqual(rows[rows.length - 1][1], 200);
+});
+
+test('the same samples give the same join whichever side uploads first', () => {
+  const reports = [[B, [100, 105, 110, 115, 120]], [A, [110, 200, 300]]];
+  assert.deepStrictEqual(join([...reports].reverse()), join(reports));
+});
+
+test('samples within the tolerance are one observation', () => {
+  const rows = join([[A, [100, 160, 220]], [B, [130, 190, 250]]]);
+  assert.deepStrictEqual(rows.map(([time]) => time), [100, 160, 220]);
+});
+
+test('events-only uploads reach the agreed exposure when the devices do', () => {
+  // LOG_EVENTS_ONLY cadence, each side's filtered RSSI: first_seen, close_start, two
+  // summaries LOG_SUMMARY_INTERVAL apart, close_end
+  const trace = (offset) => [[0, -70], [30, -59], [330, -55], [630, -55], [700, -65]]
+    .map(([time, rssi]) => ({ time: 1000 + time + offset, rssi, exposure: false }));
+  const pair = new PairJoin(A, B);
+  const rows = [...pair.add(A, trace(0)), ...pair.add(B, trace(5)), ...pair.merge(Infinity)]
+    .map((row) => row.split(',')).map((fields) => [Number(fields[0]), Number(fields[7]), fields[8]]);
+  assert.deepStrictEqual(rows, [[1000, 0, 'NO_EXPOSURE'], [1030, 0, 'NO_EXPOSURE'], [1330, 300, 'EXPOSURE'],
+    [1630, 600, 'EXPOSURE'], [1700, 670, 'EXPOSURE']]);
+});